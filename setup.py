@@ -45,9 +45,15 @@ setup(
             [
                 "src/helpers/helpers.c",
                 "src/timestamp.c",
+                "src/registry.c",
                 "src/pack.c",
+                "src/packer.c",
                 "src/object.c",
                 "src/unpack.c",
+                "src/unpacker.c",
+                "src/view.c",
+                "src/record.c",
+                "src/dictionary.c",
                 "src/msgpack.c"
             ],
             define_macros=[PKG_VERSION]
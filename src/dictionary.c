@@ -0,0 +1,207 @@
+#include "msgpack.h"
+
+
+/* --------------------------------------------------------------------------
+   Dictionary
+   -------------------------------------------------------------------------- */
+
+/* A dictionary is a vocabulary of strs and classes shared out of band by the
+   packing and the unpacking sides: its items are packed as their index in it
+   (see MSGPACK_EXT_PYDICTREF) and unpacked as the items themselves (strs are
+   interned and hashed once and for all). */
+
+
+static PyObject *
+_Dictionary_New(PyTypeObject *type, PyObject *iterable)
+{
+    Dictionary *self = NULL;
+    PyObject *fast = NULL, *items = NULL, *index = NULL, *item = NULL;
+    PyObject *value = NULL;
+    Py_ssize_t len, i;
+    int res = 0;
+
+    if (!(fast = PySequence_Fast(iterable, "expected an iterable"))) {
+        return NULL;
+    }
+    if ((len = PySequence_Fast_GET_SIZE(fast)) >= MSGPACK_UINT4_MAX) {
+        PyErr_SetString(PyExc_ValueError, "too many items");
+        Py_DECREF(fast);
+        return NULL;
+    }
+    if ((items = PyTuple_New(len)) && (index = PyDict_New())) {
+        for (i = 0; i < len; ++i) {
+            item = PySequence_Fast_GET_ITEM(fast, i);
+            if (!PyUnicode_CheckExact(item) && !PyType_Check(item)) {
+                PyErr_Format(
+                    PyExc_TypeError,
+                    "dictionary items must be strings or classes, "
+                    "not '%.200s'",
+                    Py_TYPE(item)->tp_name
+                );
+                break;
+            }
+            Py_INCREF(item);
+            if (PyUnicode_CheckExact(item)) {
+                PyUnicode_InternInPlace(&item);
+            }
+            PyTuple_SET_ITEM(items, i, item); // steals ref
+            if ((res = PyDict_Contains(index, item))) {
+                if (res > 0) {
+                    PyErr_Format(
+                        PyExc_ValueError, "duplicate dictionary item: %R", item
+                    );
+                }
+                break;
+            }
+            if (
+                !(value = PyLong_FromSsize_t(i)) ||
+                PyDict_SetItem(index, item, value)
+            ) {
+                Py_XDECREF(value);
+                break;
+            }
+            Py_DECREF(value);
+        }
+        if (
+            (i == len) &&
+            (self = PyObject_GC_NEW(Dictionary, type))
+        ) {
+            self->items = Py_NewRef(items);
+            self->index = Py_NewRef(index);
+            PyObject_GC_Track(self);
+        }
+    }
+    Py_XDECREF(index);
+    Py_XDECREF(items);
+    Py_DECREF(fast);
+    return _PyObject_CAST(self);
+}
+
+
+/* Dictionary_Type ---------------------------------------------------------- */
+
+/* Dictionary_Type.tp_new */
+static PyObject *
+Dictionary_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"items", NULL};
+    PyObject *items = NULL;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "O:__new__", kwlist, &items
+        )
+    ) {
+        return NULL;
+    }
+    return _Dictionary_New(type, items);
+}
+
+
+/* Dictionary_Type.tp_traverse */
+static int
+Dictionary_tp_traverse(Dictionary *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self)); // heap type
+    Py_VISIT(self->items);
+    Py_VISIT(self->index);
+    return 0;
+}
+
+
+/* Dictionary_Type.tp_clear */
+static int
+Dictionary_tp_clear(Dictionary *self)
+{
+    Py_CLEAR(self->index);
+    Py_CLEAR(self->items);
+    return 0;
+}
+
+
+/* Dictionary_Type.tp_dealloc */
+static void
+Dictionary_tp_dealloc(Dictionary *self)
+{
+    PyObject_GC_UnTrack(self);
+    Dictionary_tp_clear(self);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
+}
+
+
+/* Dictionary_Type.mp_length */
+static Py_ssize_t
+Dictionary_mp_length(Dictionary *self)
+{
+    return PyTuple_GET_SIZE(self->items);
+}
+
+
+/* Dictionary_Type.tp_members */
+static PyMemberDef Dictionary_tp_members[] = {
+    {
+        "items", T_OBJECT, offsetof(Dictionary, items),
+        READONLY, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot Dictionary_Slots[] = {
+    {Py_tp_doc, "Dictionary(items)"},
+    {Py_tp_new, Dictionary_tp_new},
+    {Py_tp_traverse, Dictionary_tp_traverse},
+    {Py_tp_clear, Dictionary_tp_clear},
+    {Py_tp_dealloc, Dictionary_tp_dealloc},
+    {Py_mp_length, Dictionary_mp_length},
+    {Py_tp_members, Dictionary_tp_members},
+    {0, NULL}
+};
+
+
+PyType_Spec Dictionary_Spec = {
+    .name = "mood.msgpack.Dictionary",
+    .basicsize = sizeof(Dictionary),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = Dictionary_Slots
+};
+
+
+/* --------------------------------------------------------------------------
+   interface
+   -------------------------------------------------------------------------- */
+
+/* obj must be None (returns NULL without an exception set) or a dictionary
+   (returns it, borrowed) */
+PyObject *
+DictionaryArg(module_state *state, PyObject *obj)
+{
+    if (obj == Py_None) {
+        return NULL;
+    }
+    if (!PyObject_TypeCheck(obj, (PyTypeObject *)state->dictionary_type)) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "expected a dictionary or None, not '%.200s'",
+            Py_TYPE(obj)->tp_name
+        );
+        return NULL;
+    }
+    return obj;
+}
+
+
+/* returns -1 if obj is not in the dictionary, -2 on error */
+Py_ssize_t
+DictionaryIndex(Dictionary *self, PyObject *obj)
+{
+    PyObject *index = NULL;
+
+    // borrowed
+    if (!(index = PyDict_GetItemWithError(self->index, obj))) {
+        return PyErr_Occurred() ? -2 : -1;
+    }
+    return PyLong_AsSsize_t(index);
+}
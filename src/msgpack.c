@@ -1,41 +1,181 @@
 #include "msgpack.h"
 
 
+#define _UnpackFlags_(ck, bv) \
+    ( \
+        ((ck) ? MSGPACK_UNPACK_CACHE_KEYS : MSGPACK_UNPACK_DEFAULT) | \
+        ((bv) ? MSGPACK_UNPACK_BIN_VIEWS : MSGPACK_UNPACK_DEFAULT) \
+    )
+
+
+#define _PackFlags_(m, ds) \
+    ( \
+        ((m) ? MSGPACK_PACK_MEMO : MSGPACK_PACK_DEFAULT) | \
+        ((ds) ? MSGPACK_PACK_STRINGS : MSGPACK_PACK_DEFAULT) \
+    )
+
+
 /* --------------------------------------------------------------------------
    module
    -------------------------------------------------------------------------- */
 
 /* msgpack.pack() */
 PyDoc_STRVAR(msgpack_pack_doc,
-"pack(obj) -> msg");
+"pack(obj, *, memo=False, dedup_strings=False, dictionary=None) -> msg");
 
 static PyObject *
-msgpack_pack(PyObject *module, PyObject *obj)
+msgpack_pack(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    PyObject *msg = NULL;
+    static char *kwlist[] = {"", "memo", "dedup_strings", "dictionary", NULL};
+    module_state *state = NULL;
+    PyObject *obj = NULL, *arg = Py_None, *dictionary = NULL;
+    int memo = 0, dedup_strings = 0;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "O|$ppO:pack", kwlist,
+            &obj, &memo, &dedup_strings, &arg
+        ) ||
+        !(state = __PyModule_GetState__(module)) ||
+        (!(dictionary = DictionaryArg(state, arg)) && PyErr_Occurred())
+    ) {
+        return NULL;
+    }
+    return PackMessage(
+        module, obj, _PackFlags_(memo, dedup_strings), dictionary
+    );
+}
+
+
+/* msgpack.pack_into() */
+PyDoc_STRVAR(msgpack_pack_into_doc,
+"pack_into(buffer, obj[, offset=0]) -> int");
+
+static PyObject *
+msgpack_pack_into(PyObject *module, PyObject *args)
+{
+    PyObject *obj = NULL, *result = NULL;
+    Py_buffer buffer;
+    Py_ssize_t offset = 0, size = -1;
+
+    if (PyArg_ParseTuple(args, "w*O|n:pack_into", &buffer, &obj, &offset)) {
+        if (offset < 0) {
+            offset += buffer.len;
+        }
+        if ((size = PackMessageInto(module, &buffer, offset, obj)) >= 0) {
+            result = PyLong_FromSsize_t(size);
+        }
+        PyBuffer_Release(&buffer);
+    }
+    return result;
+}
+
+
+/* msgpack.pack_many() */
+PyDoc_STRVAR(msgpack_pack_many_doc,
+"pack_many(iterable) -> (msg, offsets)");
+
+static PyObject *
+msgpack_pack_many(PyObject *module, PyObject *iterable)
+{
+    pack_context context;
+    PyObject *fast = NULL, *msg = NULL, *offsets = NULL, *result = NULL;
+    PyObject *offset = NULL;
+    Py_ssize_t len, i;
+
+    if (!(fast = PySequence_Fast(iterable, "expected an iterable"))) {
+        return NULL;
+    }
+    len = PySequence_Fast_GET_SIZE(fast);
+    if (
+        !InitPackContext(&context, module, MSGPACK_PACK_DEFAULT) &&
+        (msg = NewMessage()) &&
+        (offsets = PyList_New(len))
+    ) {
+        for (i = 0; i < len; ++i) {
+            if (!(offset = PyLong_FromSsize_t(PyByteArray_GET_SIZE(msg)))) {
+                break;
+            }
+            PyList_SET_ITEM(offsets, i, offset); // steals ref
+            if (PackObject(&context, msg, PySequence_Fast_GET_ITEM(fast, i))) {
+                break;
+            }
+        }
+        if (i == len) {
+            result = PyTuple_Pack(2, msg, offsets);
+        }
+    }
+    ClearPackContext(&context);
+    Py_XDECREF(offsets);
+    Py_XDECREF(msg);
+    Py_DECREF(fast);
+    return result;
+}
 
-    if ((msg = NewMessage()) && PackObject(module, msg, obj)) {
-        Py_CLEAR(msg);
+
+/* msgpack.packed_size() */
+PyDoc_STRVAR(msgpack_packed_size_doc,
+"packed_size(obj) -> int");
+
+static PyObject *
+msgpack_packed_size(PyObject *module, PyObject *obj)
+{
+    Py_ssize_t size = -1;
+
+    if ((size = PackedSize(module, obj)) < 0) {
+        return NULL;
     }
-    return msg;
+    return PyLong_FromSsize_t(size);
 }
 
 
 /* msgpack.register() */
 PyDoc_STRVAR(msgpack_register_doc,
-"register(*args)");
+"register(*args, id=None)");
 
 static PyObject *
-msgpack_register(PyObject *module, PyObject *args)
+msgpack_register(PyObject *module, PyObject *args, PyObject *kwargs)
 {
+    static char *kwlist[] = {"id", NULL};
     module_state *state = NULL;
-    Py_ssize_t len = PyTuple_GET_SIZE(args), i;
+    PyObject *empty = NULL, *id = Py_None, *cls = NULL;
+    Py_ssize_t len = PyTuple_GET_SIZE(args), value = -1, i;
+    int res = 0;
 
     if (!(state = __PyModule_GetState__(module))) {
         return NULL;
     }
+    if (kwargs) {
+        if (!(empty = PyTuple_New(0))) {
+            return NULL;
+        }
+        res = PyArg_ParseTupleAndKeywords(
+            empty, kwargs, "|$O:register", kwlist, &id
+        );
+        Py_DECREF(empty);
+        if (!res) {
+            return NULL;
+        }
+    }
+    if (id != Py_None) {
+        if ((len != 1) || !PyType_Check((cls = PyTuple_GET_ITEM(args, 0)))) {
+            PyErr_SetString(
+                PyExc_TypeError, "register() takes a single class with an id"
+            );
+            return NULL;
+        }
+        if (
+            (
+                ((value = PyNumber_AsSsize_t(id, PyExc_OverflowError)) == -1) &&
+                PyErr_Occurred()
+            ) ||
+            RegisterClassId(state, cls, value)
+        ) {
+            return NULL;
+        }
+    }
     for (i = 0; i < len; ++i) {
-        if (RegisterObject(state->registry, PyTuple_GET_ITEM(args, i))) {
+        if (RegisterObject(&state->registry, PyTuple_GET_ITEM(args, i))) {
             return NULL;
         }
     }
@@ -43,19 +183,234 @@ msgpack_register(PyObject *module, PyObject *args)
 }
 
 
+/* msgpack.compile() */
+PyDoc_STRVAR(msgpack_compile_doc,
+"compile(cls, *, fields=None) -> record");
+
+static PyObject *
+msgpack_compile(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"", "fields", NULL};
+    module_state *state = NULL;
+    PyObject *cls = NULL, *fields = Py_None, *record = NULL;
+
+    if (
+        PyArg_ParseTupleAndKeywords(
+            args, kwargs, "O|$O:compile", kwlist, &cls, &fields
+        ) &&
+        (state = __PyModule_GetState__(module)) &&
+        (record = NewRecord(state, cls, fields)) &&
+        RegisterRecord(state, record)
+    ) {
+        Py_CLEAR(record);
+    }
+    return record;
+}
+
+
 /* msgpack.unpack() */
 PyDoc_STRVAR(msgpack_unpack_doc,
-"unpack(msg) -> obj");
+"unpack(msg, *, cache_keys=False, bin_views=False, select=None, "
+"dictionary=None) -> obj");
 
 static PyObject *
-msgpack_unpack(PyObject *module, PyObject *args)
+msgpack_unpack(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    PyObject *result = NULL;
+    static char *kwlist[] = {
+        "", "cache_keys", "bin_views", "select", "dictionary", NULL
+    };
+    unpack_context context;
+    PyObject *result = NULL, *select = Py_None, *selection = NULL;
+    PyObject *arg = Py_None;
     Py_buffer msg;
     Py_ssize_t off = 0;
+    int cache_keys = 0, bin_views = 0;
 
-    if (PyArg_ParseTuple(args, "y*:unpack", &msg)) {
-        result = UnpackMessage(module, &msg, &off);
+    if (
+        PyArg_ParseTupleAndKeywords(
+            args, kwargs, "y*|$ppOO:unpack", kwlist,
+            &msg, &cache_keys, &bin_views, &select, &arg
+        )
+    ) {
+        if (
+            !InitUnpackContext(
+                &context, module, _UnpackFlags_(cache_keys, bin_views)
+            ) &&
+            (
+                (context.dictionary = DictionaryArg(context.state, arg)) ||
+                !PyErr_Occurred()
+            )
+        ) {
+            if (select == Py_None) {
+                result = UnpackMessage(&context, &msg, &off);
+            }
+            else if ((selection = NewSelection(select))) {
+                result = UnpackSelection(&context, &msg, &off, selection);
+                Py_DECREF(selection);
+            }
+        }
+        ClearUnpackContext(&context);
+        PyBuffer_Release(&msg);
+    }
+    return result;
+}
+
+
+/* msgpack.unpack_from() */
+PyDoc_STRVAR(msgpack_unpack_from_doc,
+"unpack_from(msg, offset=0, *, cache_keys=False, bin_views=False) -> "
+"(obj, offset)");
+
+static PyObject *
+msgpack_unpack_from(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"", "offset", "cache_keys", "bin_views", NULL};
+    unpack_context context;
+    PyObject *obj = NULL, *result = NULL;
+    Py_buffer msg;
+    Py_ssize_t off = 0;
+    int cache_keys = 0, bin_views = 0;
+
+    if (
+        PyArg_ParseTupleAndKeywords(
+            args, kwargs, "y*|n$pp:unpack_from", kwlist,
+            &msg, &off, &cache_keys, &bin_views
+        )
+    ) {
+        if (off < 0) {
+            off += msg.len;
+        }
+        if ((off < 0) || (off > msg.len)) {
+            PyErr_Format(
+                PyExc_ValueError,
+                "offset %zd out of range for %zd-byte buffer", off, msg.len
+            );
+        }
+        else {
+            if (
+                !InitUnpackContext(
+                    &context, module, _UnpackFlags_(cache_keys, bin_views)
+                ) &&
+                (obj = UnpackMessage(&context, &msg, &off))
+            ) {
+                result = Py_BuildValue("(Nn)", obj, off);
+            }
+            ClearUnpackContext(&context);
+        }
+        PyBuffer_Release(&msg);
+    }
+    return result;
+}
+
+
+/* msgpack.iter_unpack() */
+PyDoc_STRVAR(msgpack_iter_unpack_doc,
+"iter_unpack(msg, *, cache_keys=False, bin_views=False) -> iterator");
+
+static PyObject *
+msgpack_iter_unpack(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"", "cache_keys", "bin_views", NULL};
+    module_state *state = NULL;
+    PyObject *msg = NULL;
+    int cache_keys = 0, bin_views = 0;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "O|$pp:iter_unpack", kwlist,
+            &msg, &cache_keys, &bin_views
+        ) ||
+        !(state = __PyModule_GetState__(module))
+    ) {
+        return NULL;
+    }
+    return NewUnpackIterator(
+        state->unpack_iterator_type, module, msg,
+        _UnpackFlags_(cache_keys, bin_views)
+    );
+}
+
+
+/* msgpack.unpack_many() */
+PyDoc_STRVAR(msgpack_unpack_many_doc,
+"unpack_many(msg, *, cache_keys=False, bin_views=False) -> list");
+
+static PyObject *
+msgpack_unpack_many(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"", "cache_keys", "bin_views", NULL};
+    unpack_context context;
+    PyObject *result = NULL, *obj = NULL;
+    Py_buffer msg;
+    Py_ssize_t off = 0;
+    int cache_keys = 0, bin_views = 0;
+
+    if (
+        PyArg_ParseTupleAndKeywords(
+            args, kwargs, "y*|$pp:unpack_many", kwlist,
+            &msg, &cache_keys, &bin_views
+        )
+    ) {
+        if (
+            !InitUnpackContext(
+                &context, module, _UnpackFlags_(cache_keys, bin_views)
+            ) &&
+            (result = PyList_New(0))
+        ) {
+            while (off < msg.len) {
+                if (
+                    !(obj = UnpackMessage(&context, &msg, &off)) ||
+                    PyList_Append(result, obj)
+                ) {
+                    Py_XDECREF(obj);
+                    Py_CLEAR(result);
+                    break;
+                }
+                Py_DECREF(obj);
+            }
+        }
+        ClearUnpackContext(&context);
+        PyBuffer_Release(&msg);
+    }
+    return result;
+}
+
+
+/* msgpack.validate() */
+PyDoc_STRVAR(msgpack_validate_doc,
+"validate(msg, *, max_depth=1024, max_size=-1) -> (ok, offset)");
+
+static PyObject *
+msgpack_validate(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"", "max_depth", "max_size", NULL};
+    PyObject *result = NULL;
+    Py_buffer msg;
+    Py_ssize_t max_depth = MSGPACK_SKIP_DEPTH_MAX, max_size = -1, off = 0;
+    int ok = 0;
+
+    if (
+        PyArg_ParseTupleAndKeywords(
+            args, kwargs, "y*|$nn:validate", kwlist,
+            &msg, &max_depth, &max_size
+        )
+    ) {
+        if ((max_depth < 0) || (max_depth > MSGPACK_SKIP_DEPTH_MAX)) {
+            PyErr_Format(
+                PyExc_ValueError,
+                "argument 'max_depth' must be between 0 and %d",
+                MSGPACK_SKIP_DEPTH_MAX
+            );
+        }
+        else {
+            ok = SkipMessage(
+                msg.buf,
+                ((max_size < 0) ? msg.len : Py_MIN(msg.len, max_size)),
+                max_depth,
+                &off
+            );
+            result = Py_BuildValue("(On)", (ok ? Py_True : Py_False), off);
+        }
         PyBuffer_Release(&msg);
     }
     return result;
@@ -64,13 +419,35 @@ msgpack_unpack(PyObject *module, PyObject *args)
 
 /* msgpack_def.m_methods */
 static PyMethodDef msgpack_m_methods[] = {
-    {"pack", (PyCFunction)msgpack_pack, METH_O, msgpack_pack_doc},
-    {"register", (PyCFunction)msgpack_register, METH_VARARGS, msgpack_register_doc},
-    {"unpack", (PyCFunction)msgpack_unpack, METH_VARARGS, msgpack_unpack_doc},
+    {"pack", (PyCFunction)msgpack_pack, METH_VARARGS | METH_KEYWORDS, msgpack_pack_doc},
+    {"pack_into", (PyCFunction)msgpack_pack_into, METH_VARARGS, msgpack_pack_into_doc},
+    {"pack_many", (PyCFunction)msgpack_pack_many, METH_O, msgpack_pack_many_doc},
+    {"packed_size", (PyCFunction)msgpack_packed_size, METH_O, msgpack_packed_size_doc},
+    {"register", (PyCFunction)msgpack_register, METH_VARARGS | METH_KEYWORDS, msgpack_register_doc},
+    {"compile", (PyCFunction)msgpack_compile, METH_VARARGS | METH_KEYWORDS, msgpack_compile_doc},
+    {"unpack", (PyCFunction)msgpack_unpack, METH_VARARGS | METH_KEYWORDS, msgpack_unpack_doc},
+    {"unpack_from", (PyCFunction)msgpack_unpack_from, METH_VARARGS | METH_KEYWORDS, msgpack_unpack_from_doc},
+    {"unpack_many", (PyCFunction)msgpack_unpack_many, METH_VARARGS | METH_KEYWORDS, msgpack_unpack_many_doc},
+    {"iter_unpack", (PyCFunction)msgpack_iter_unpack, METH_VARARGS | METH_KEYWORDS, msgpack_iter_unpack_doc},
+    {"validate", (PyCFunction)msgpack_validate, METH_VARARGS | METH_KEYWORDS, msgpack_validate_doc},
     {NULL} /* Sentinel */
 };
 
 
+/* array.array */
+static PyObject *
+__array_type(void)
+{
+    PyObject *array = NULL, *result = NULL;
+
+    if ((array = PyImport_ImportModule("array"))) {
+        result = PyObject_GetAttrString(array, "array");
+        Py_DECREF(array);
+    }
+    return result;
+}
+
+
 /* msgpack_def.m_slots.Py_mod_exec */
 static int
 msgpack_m_slots_exec(PyObject *module)
@@ -79,12 +456,64 @@ msgpack_m_slots_exec(PyObject *module)
 
     if (
         !(state = __PyModule_GetState__(module)) ||
-        !(state->registry = PyDict_New()) ||
-        RegisterObject(state->registry, Py_NotImplemented) ||
-        RegisterObject(state->registry, Py_Ellipsis) ||
+        RegisterObject(&state->registry, Py_NotImplemented) ||
+        RegisterObject(&state->registry, Py_Ellipsis) ||
+        !(state->array_type = __array_type()) ||
+        !(state->records = PyDict_New()) ||
+        !(state->class_ids = PyDict_New()) ||
+        !(state->str_dict = PyUnicode_InternFromString("__dict__")) ||
+        !(state->str_setstate = PyUnicode_InternFromString("__setstate__")) ||
+        !(state->str_extend = PyUnicode_InternFromString("extend")) ||
+        !(state->str_update = PyUnicode_InternFromString("update")) ||
+        !(state->str_module = PyUnicode_InternFromString("__module__")) ||
+        !(state->str_qualname = PyUnicode_InternFromString("__qualname__")) ||
+        !(state->str_slots = PyUnicode_InternFromString("__slots__")) ||
+        !(
+            state->str_dataclass_fields = PyUnicode_InternFromString(
+                "__dataclass_fields__"
+            )
+        ) ||
+        !(state->str_fields = PyUnicode_InternFromString("fields")) ||
+        !(state->str_name = PyUnicode_InternFromString("name")) ||
+        !(state->str_frombytes = PyUnicode_InternFromString("frombytes")) ||
+        !(state->str_cast = PyUnicode_InternFromString("cast")) ||
+        !(state->str_toreadonly = PyUnicode_InternFromString("toreadonly")) ||
+        !(state->str_reduce = PyUnicode_InternFromString("__reduce__")) ||
+        !(state->str_reduce_ex = PyUnicode_InternFromString("__reduce_ex__")) ||
+        !(state->str_getstate = PyUnicode_InternFromString("__getstate__")) ||
+        !(
+            state->str_getnewargs = PyUnicode_InternFromString(
+                "__getnewargs__"
+            )
+        ) ||
+        !(
+            state->str_getnewargs_ex = PyUnicode_InternFromString(
+                "__getnewargs_ex__"
+            )
+        ) ||
         _PyModule_AddTypeFromSpec(
             module, &Timestamp_Spec, NULL, &state->timestamp_type
         ) ||
+        _PyModule_AddTypeFromSpec(
+            module, &Packer_Spec, NULL, &state->packer_type
+        ) ||
+        _PyModule_AddTypeFromSpec(
+            module, &Unpacker_Spec, NULL, &state->unpacker_type
+        ) ||
+        _PyModule_AddTypeFromSpec(
+            module, &View_Spec, NULL, &state->view_type
+        ) ||
+        _PyModule_AddTypeFromSpec(
+            module, &Record_Spec, NULL, &state->record_type
+        ) ||
+        _PyModule_AddTypeFromSpec(
+            module, &Dictionary_Spec, NULL, &state->dictionary_type
+        ) ||
+        !(
+            state->unpack_iterator_type = PyType_FromModuleAndSpec(
+                module, &UnpackIterator_Spec, NULL
+            )
+        ) ||
         PyModule_AddStringConstant(module, "__version__", PKG_VERSION)
     ) {
         return -1;
@@ -105,13 +534,29 @@ static int
 msgpack_m_traverse(PyObject *module, visitproc visit, void *arg)
 {
     module_state *state = NULL;
+    Py_ssize_t i;
+    int res = 0;
 
     if (!(state = __PyModule_GetState__(module))) {
         return -1;
     }
+    for (i = 0; i < state->nclasses; ++i) {
+        Py_VISIT(state->classes[i]);
+    }
+    Py_VISIT(state->class_ids);
+    Py_VISIT(state->records);
+    Py_VISIT(state->array_type);
+    Py_VISIT(state->dictionary_type);
+    Py_VISIT(state->record_type);
+    Py_VISIT(state->view_type);
+    Py_VISIT(state->unpack_iterator_type);
+    Py_VISIT(state->unpacker_type);
+    Py_VISIT(state->packer_type);
     Py_VISIT(state->timestamp_type);
-    Py_VISIT(state->registry);
-    return 0;
+    if ((res = RegistryTraverse(&state->record_tags, visit, arg))) {
+        return res;
+    }
+    return RegistryTraverse(&state->registry, visit, arg);
 }
 
 
@@ -120,12 +565,49 @@ static int
 msgpack_m_clear(PyObject *module)
 {
     module_state *state = NULL;
+    Py_ssize_t i;
 
     if (!(state = __PyModule_GetState__(module))) {
         return -1;
     }
+    Py_CLEAR(state->str_getnewargs_ex);
+    Py_CLEAR(state->str_getnewargs);
+    Py_CLEAR(state->str_getstate);
+    Py_CLEAR(state->str_reduce_ex);
+    Py_CLEAR(state->str_reduce);
+    Py_CLEAR(state->str_toreadonly);
+    Py_CLEAR(state->str_cast);
+    Py_CLEAR(state->str_frombytes);
+    Py_CLEAR(state->str_name);
+    Py_CLEAR(state->str_fields);
+    Py_CLEAR(state->str_dataclass_fields);
+    Py_CLEAR(state->str_slots);
+    Py_CLEAR(state->str_qualname);
+    Py_CLEAR(state->str_module);
+    Py_CLEAR(state->str_update);
+    Py_CLEAR(state->str_extend);
+    Py_CLEAR(state->str_setstate);
+    Py_CLEAR(state->str_dict);
+    for (i = 0; i < state->nclasses; ++i) {
+        Py_CLEAR(state->classes[i]);
+    }
+    PyMem_Free(state->classes);
+    state->classes = NULL;
+    state->nclasses = 0;
+    Py_CLEAR(state->class_ids);
+    Py_CLEAR(state->records);
+    Py_CLEAR(state->array_type);
+    Py_CLEAR(state->dictionary_type);
+    Py_CLEAR(state->record_type);
+    Py_CLEAR(state->view_type);
+    Py_CLEAR(state->unpack_iterator_type);
+    Py_CLEAR(state->unpacker_type);
+    Py_CLEAR(state->packer_type);
     Py_CLEAR(state->timestamp_type);
-    Py_CLEAR(state->registry);
+    ClearKeyCache(state->key_cache);
+    ClearClassCache(state->class_cache);
+    RegistryClear(&state->record_tags);
+    RegistryClear(&state->registry);
     return 0;
 }
 
@@ -58,20 +58,305 @@ extern PyType_Spec Timestamp_Spec;
 PyObject *NewTimestamp(PyObject *type, int64_t seconds, uint32_t nanoseconds);
 
 
+/* Packer */
+typedef struct {
+    PyObject_HEAD
+    PyObject *module;
+    PyObject *msg;
+    Py_ssize_t high_water;
+    PyObject *dictionary;   // NULL if none
+} Packer;
+
+extern PyType_Spec Packer_Spec;
+
+
+/* scan state (see ScanMessage()) */
+typedef struct {
+    Py_ssize_t off;         // end of the scanned part of the message
+    Py_ssize_t depth;       // number of unfinished arrays/maps
+    Py_ssize_t alloc;
+    Py_ssize_t *pending;    // objects left to scan for each of them
+} scan_state;
+
+
+/* Unpacker */
+typedef struct {
+    PyObject_HEAD
+    PyObject *module;
+    char *buffer;
+    Py_ssize_t start;       // start of the next message
+    Py_ssize_t len;
+    Py_ssize_t alloc;
+    scan_state scan;
+    int flags;
+    int unpacking;
+    PyObject *dictionary;   // NULL if none
+} Unpacker;
+
+extern PyType_Spec Unpacker_Spec;
+
+
+/* UnpackIterator */
+typedef struct {
+    PyObject_HEAD
+    PyObject *module;
+    Py_buffer msg;
+    Py_ssize_t off;
+    int flags;
+} UnpackIterator;
+
+extern PyType_Spec UnpackIterator_Spec;
+
+PyObject *NewUnpackIterator(
+    PyObject *type, PyObject *module, PyObject *obj, int flags
+);
+
+
+/* View */
+typedef struct {
+    PyObject_HEAD
+    PyObject *module;
+    PyObject *root;         // NULL for the root view (which owns msg)
+    Py_buffer msg;
+    Py_ssize_t start;       // start of the object
+    Py_ssize_t off;         // start of its items
+    Py_ssize_t len;         // number of items (keys and values for maps)
+    Py_ssize_t indexed;
+    Py_ssize_t *index;      // offsets of the items walked so far
+    scan_state scan;
+    int kind;
+    PyObject *dictionary;   // NULL if none
+} View;
+
+extern PyType_Spec View_Spec;
+
+
+/* Record */
+typedef struct {
+    PyObject_HEAD
+    PyTypeObject *cls;
+    PyObject *fields;       // tuple of interned str
+    Py_ssize_t *offsets;    // of the fields stored in slots (0 otherwise)
+    uint32_t tag;
+} Record;
+
+extern PyType_Spec Record_Spec;
+
+PyObject *RecordGetField(Record *self, PyObject *obj, Py_ssize_t i);
+PyObject *RecordNewInstance(Record *self);
+int RecordSetField(Record *self, PyObject *obj, Py_ssize_t i, PyObject *value);
+
+
+/* Dictionary */
+typedef struct {
+    PyObject_HEAD
+    PyObject *items;        // tuple of interned str and classes
+    PyObject *index;        // {item: index}
+} Dictionary;
+
+extern PyType_Spec Dictionary_Spec;
+
+
+/* registry */
+typedef struct {
+    Py_hash_t hash;
+    Py_ssize_t len;
+    char *key;              // packed representation of value
+    PyObject *value;
+} registry_entry;
+
+typedef struct {
+    Py_ssize_t size;
+    Py_ssize_t mask;
+    registry_entry *entries;
+} registry_table;
+
+int RegistrySet(
+    registry_table *registry, const char *key, Py_ssize_t len, PyObject *obj
+);
+PyObject *RegistryGet(registry_table *registry, const char *key, Py_ssize_t len);
+int RegistryTraverse(registry_table *registry, visitproc visit, void *arg);
+void RegistryClear(registry_table *registry);
+
+
+/* class cache (see _PyClass_Pack()) */
+#define MSGPACK_CLASS_CACHE_SIZE 256    // power of 2
+
+typedef struct {
+    PyTypeObject *type;     // borrowed
+    unsigned int version;   // type->tp_version_tag
+    Py_ssize_t len;
+    char *data;             // packed representation of type
+    int plain;              // see _PyInstance_Pack()
+    Py_ssize_t id;          // see RegisterClassId(), -1 if none
+} class_cache_entry;
+
+
+
+/* method cache (see __PyObject_Build()) */
+#define MSGPACK_METHOD_CACHE_SIZE 256   // power of 2
+
+typedef struct {
+    PyTypeObject *type;     // borrowed
+    unsigned int version;   // type->tp_version_tag
+    int methods;            // which of __setstate__/extend/update type has
+} method_cache_entry;
+
+
+/* key cache (see __unpack_key()) */
+#define MSGPACK_KEY_CACHE_SIZE 512      // power of 2
+
+
 /* module state */
 typedef struct {
-    PyObject *registry;
+    registry_table registry;
+    registry_table record_tags;     // packed tag -> Record
+    PyObject *records;              // {class: Record}
+    PyObject *class_ids;            // {class: id}
+    PyObject **classes;             // classes by id, NULL if unused
+    Py_ssize_t nclasses;
+    class_cache_entry class_cache[MSGPACK_CLASS_CACHE_SIZE];
+    PyObject *key_cache[MSGPACK_KEY_CACHE_SIZE];    // interned str
+    method_cache_entry method_cache[MSGPACK_METHOD_CACHE_SIZE];
+    PyObject *str_dict;         // interned "__dict__"
+    PyObject *str_setstate;     // interned "__setstate__"
+    PyObject *str_extend;       // interned "extend"
+    PyObject *str_update;       // interned "update"
+    PyObject *str_module;       // interned "__module__"
+    PyObject *str_qualname;     // interned "__qualname__"
+    PyObject *str_slots;        // interned "__slots__"
+    PyObject *str_dataclass_fields; // interned "__dataclass_fields__"
+    PyObject *str_fields;       // interned "fields"
+    PyObject *str_name;         // interned "name"
+    PyObject *str_frombytes;    // interned "frombytes"
+    PyObject *str_cast;         // interned "cast"
+    PyObject *str_toreadonly;   // interned "toreadonly"
+    PyObject *str_reduce;       // interned "__reduce__"
+    PyObject *str_reduce_ex;    // interned "__reduce_ex__"
+    PyObject *str_getstate;     // interned "__getstate__"
+    PyObject *str_getnewargs;   // interned "__getnewargs__"
+    PyObject *str_getnewargs_ex; // interned "__getnewargs_ex__"
     PyObject *timestamp_type;
+    PyObject *packer_type;
+    PyObject *unpacker_type;
+    PyObject *unpack_iterator_type;
+    PyObject *view_type;
+    PyObject *record_type;
+    PyObject *dictionary_type;
+    PyObject *array_type;   // array.array
 } module_state;
 
 
+/* pack context */
+enum {
+    MSGPACK_PACK_DEFAULT = 0,
+    MSGPACK_PACK_MEMO    = 1 << 0,
+    MSGPACK_PACK_STRINGS = 1 << 1
+};
+
+/* memo (see PackMessage()), objects are keyed on their address and kept alive
+   until the end of the message so that addresses are not reused */
+typedef struct {
+    PyObject *obj;
+    Py_ssize_t index;
+} memo_entry;
+
+typedef struct {
+    Py_ssize_t size;
+    Py_ssize_t mask;
+    memo_entry *entries;
+} memo_table;
+
+/* a context is used for a single message */
+typedef struct {
+    PyObject *module;       // borrowed
+    module_state *state;
+    int flags;
+    memo_table memo;
+    PyObject *strings;      // {str: index} (MSGPACK_PACK_STRINGS only)
+    Py_ssize_t nstrings;    // number of str packed as such
+    PyObject *dictionary;   // borrowed, NULL if none
+} pack_context;
+
+
+/* unpack context */
+enum {
+    MSGPACK_UNPACK_DEFAULT    = 0,
+    MSGPACK_UNPACK_CACHE_KEYS = 1 << 0,
+    MSGPACK_UNPACK_BIN_VIEWS  = 1 << 1
+};
+
+/* memo (see __unpack_indexed()), objects by index */
+typedef struct {
+    Py_ssize_t len;
+    Py_ssize_t alloc;
+    PyObject **items;       // NULL while incomplete
+} unpack_memo;
+
+/* a context is used for a single message */
+typedef struct {
+    PyObject *module;       // borrowed
+    module_state *state;
+    int flags;
+    PyObject *view;         // read-only memoryview of the message
+    unpack_memo *memo;      // only while unpacking a memoized message
+    unpack_memo *strings;   // only while unpacking a deduplicated message
+    PyObject *dictionary;   // borrowed, NULL if none
+} unpack_context;
+
+
 /* interface */
 PyObject *NewMessage(void);
-int RegisterObject(PyObject *registry, PyObject *obj);
-int PackObject(PyObject *module, PyObject *msg, PyObject *obj);
-
-PyObject *__PyObject_New(PyObject *reduce);
-PyObject *UnpackMessage(PyObject *module, Py_buffer *msg, Py_ssize_t *off);
+PyObject *NewMessageOfSize(Py_ssize_t size);
+void ResetMessage(PyObject *msg);
+void ClearClassCache(class_cache_entry *cache);
+int RegisterObject(registry_table *registry, PyObject *obj);
+int RegisterClassId(module_state *state, PyObject *cls, Py_ssize_t id);
+PyObject *NewRecord(module_state *state, PyObject *cls, PyObject *fields);
+int RegisterRecord(module_state *state, PyObject *record);
+PyObject *DictionaryArg(module_state *state, PyObject *obj);
+Py_ssize_t DictionaryIndex(Dictionary *self, PyObject *obj);
+int InitPackContext(pack_context *context, PyObject *module, int flags);
+void ClearPackContext(pack_context *context);
+int PackObject(pack_context *context, PyObject *msg, PyObject *obj);
+Py_ssize_t PackedSize(PyObject *module, PyObject *obj);
+PyObject *PackMessage(
+    PyObject *module, PyObject *obj, int flags, PyObject *dictionary
+);
+Py_ssize_t PackMessageInto(
+    PyObject *module, Py_buffer *buffer, Py_ssize_t offset, PyObject *obj
+);
+
+PyObject *__PyObject_New(PyObject *callable, PyObject *args);
+int __PyObject_Build(module_state *state, PyObject *self, PyObject **items);
+PyObject *__PyObject_NewInstance(PyObject *cls);
+int __PyObject_InitInstance(PyObject *self, PyObject *dict, PyObject *slots);
+void ClearKeyCache(PyObject **cache);
+int InitUnpackContext(unpack_context *context, PyObject *module, int flags);
+void ClearUnpackContext(unpack_context *context);
+PyObject *UnpackMessage(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off
+);
+
+PyObject *NewSelection(PyObject *paths);
+PyObject *UnpackSelection(
+    unpack_context *context,
+    Py_buffer *msg,
+    Py_ssize_t *off,
+    PyObject *selection
+);
+
+void ResetScanState(scan_state *state);
+void ClearScanState(scan_state *state);
+int ScanMessage(scan_state *state, const char *buffer, Py_ssize_t len);
+Py_ssize_t ScanHeader(const char *buffer, Py_ssize_t len, Py_ssize_t *items);
+Py_ssize_t ScanExtension(const char *buffer, Py_ssize_t len, uint8_t type);
+
+#define MSGPACK_SKIP_DEPTH_MAX 1024
+
+int SkipMessage(
+    const char *buffer, Py_ssize_t len, Py_ssize_t max_depth, Py_ssize_t *off
+);
 
 
 /* --------------------------------------------------------------------------
@@ -176,6 +461,20 @@ enum {
     MSGPACK_EXT_PYCLASS     = 0x06,
     MSGPACK_EXT_PYSINGLETON = 0x07,
 
+    MSGPACK_EXT_PYARRAY      = 0x08,
+    MSGPACK_EXT_PYMEMORYVIEW = 0x09,
+
+    MSGPACK_EXT_PYRECORD   = 0x0a,
+    MSGPACK_EXT_PYINSTANCE = 0x0b,
+
+    MSGPACK_EXT_PYMEMO    = 0x0c,
+    MSGPACK_EXT_PYREF     = 0x0d,
+    MSGPACK_EXT_PYSTRINGS = 0x0e,
+    MSGPACK_EXT_PYSTRREF  = 0x0f,
+
+    MSGPACK_EXT_PYCLASSID = 0x10,
+    MSGPACK_EXT_PYDICTREF = 0x11,
+
     MSGPACK_EXT_PYOBJECT = 0x7f,    // last
 
     // msgpack
@@ -184,6 +483,28 @@ enum {
 };
 
 
+/* typed arrays (MSGPACK_EXT_PYARRAY, MSGPACK_EXT_PYMEMORYVIEW), the payload
+   starts with the typecode, the item size and the byte order of the data */
+#define MSGPACK_TYPED_HEADER 3
+#define MSGPACK_TYPED_TYPECODES "bBhHiIlLqQfd"
+
+#if PY_LITTLE_ENDIAN
+#define MSGPACK_TYPED_BYTEORDER '<'
+#else
+#define MSGPACK_TYPED_BYTEORDER '>'
+#endif
+
+
+/* records (MSGPACK_EXT_PYRECORD), the payload is the tag of the compiled
+   class followed by an array of its fields */
+#define MSGPACK_RECORD_TAG 4
+
+
+/* class ids (MSGPACK_EXT_PYCLASSID), the payload is the id the class was
+   registered with (see RegisterClassId()) in 1 or 2 bytes */
+#define MSGPACK_CLASS_ID_MAX MSGPACK_UINT2_MAX  // exclusive
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,16 +1,79 @@
 #include "msgpack.h"
 
 
+/* --------------------------------------------------------------------------
+   method cache
+   -------------------------------------------------------------------------- */
+
+/* whether a type has __setstate__(), extend() and update() is cached per type,
+   an entry is only valid as long as the type's version tag is (see
+   __class_cache_lookup() in pack.c) */
+
+enum {
+    MSGPACK_HAS_SETSTATE = 1 << 0,
+    MSGPACK_HAS_EXTEND   = 1 << 1,
+    MSGPACK_HAS_UPDATE   = 1 << 2
+};
+
+#define __method_cache_index(t) \
+    (((uintptr_t)(t) >> 4) & (MSGPACK_METHOD_CACHE_SIZE - 1))
+
+
+static int
+__PyType_Methods(module_state *state, PyTypeObject *type)
+{
+    method_cache_entry *entry = \
+        &state->method_cache[__method_cache_index(type)];
+    int methods = 0;
+
+    if (
+        (entry->type == type) &&
+        PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG) &&
+        (entry->version == type->tp_version_tag)
+    ) {
+        return entry->methods;
+    }
+    // lookups assign a version tag (if the type can have one)
+    if (_PyType_Lookup(type, state->str_setstate)) {
+        methods |= MSGPACK_HAS_SETSTATE;
+    }
+    if (_PyType_Lookup(type, state->str_extend)) {
+        methods |= MSGPACK_HAS_EXTEND;
+    }
+    if (_PyType_Lookup(type, state->str_update)) {
+        methods |= MSGPACK_HAS_UPDATE;
+    }
+    if (PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+        entry->type = type;
+        entry->version = type->tp_version_tag;
+        entry->methods = methods;
+    }
+    return methods;
+}
+
+
+static inline int
+__PyObject_CallMethodOneArg(PyObject *self, PyObject *name, PyObject *arg)
+{
+    PyObject *args[2] = { self, arg }, *result = NULL;
+
+    if (!(result = PyObject_VectorcallMethod(name, args, 2, NULL))) {
+        return -1;
+    }
+    Py_DECREF(result);
+    return 0;
+}
+
+
 // object.__setstate__()
 static inline int
-__PyObject_UpdateDict(PyObject *self, PyObject *arg)
+__PyObject_UpdateDict(module_state *state, PyObject *self, PyObject *arg)
 {
-    _Py_IDENTIFIER(__dict__);
     Py_ssize_t pos = 0;
     PyObject *dict = NULL, *key = NULL, *value = NULL;
     int res = -1;
 
-    if ((dict = _PyObject_GetAttrId(self, &PyId___dict__))) {
+    if ((dict = PyObject_GetAttr(self, state->str_dict))) {
         while ((res = PyDict_Next(arg, &pos, &key, &value))) {
             /* normally the keys for instance attributes are interned.
                we should do that here. */
@@ -39,41 +102,43 @@ __PyObject_UpdateDict(PyObject *self, PyObject *arg)
 }
 
 static inline int
-__PyObject_SetState__(PyObject *self, PyObject *arg)
+__PyObject_SetState__(
+    module_state *state, PyObject *self, PyObject *arg, int methods
+)
 {
-    _Py_IDENTIFIER(__setstate__);
-    PyObject *result = NULL;
-
-    if (
-        !(
-            result = _PyObject_CallMethodIdObjArgs(
-                self, &PyId___setstate__, arg, NULL
-            )
-        )
-    ) {
-        if (PyErr_ExceptionMatches(PyExc_AttributeError) && PyDict_Check(arg)) {
-            PyErr_Clear();
-            return __PyObject_UpdateDict(self, arg);
-        }
-        return -1;
+    if (methods & MSGPACK_HAS_SETSTATE) {
+        return __PyObject_CallMethodOneArg(self, state->str_setstate, arg);
     }
-    Py_DECREF(result);
-    return 0;
+    if (PyDict_Check(arg)) {
+        return __PyObject_UpdateDict(state, self, arg);
+    }
+    PyErr_Format(
+        PyExc_AttributeError,
+        "'%.200s' object has no attribute '__setstate__'",
+        Py_TYPE(self)->tp_name
+    );
+    return -1;
 }
 
 static int
-__PyObject_SetState(PyObject *self, PyObject *arg, PyObject *setter)
+__PyObject_SetState(
+    module_state *state,
+    PyObject *self,
+    PyObject *arg,
+    PyObject *setter,
+    int methods
+)
 {
-    PyObject *result = NULL;
+    PyObject *args[2] = { self, arg }, *result = NULL;
 
-    if (setter && setter != Py_None) {
-        if (!(result = PyObject_CallFunctionObjArgs(setter, self, arg, NULL))) {
+    if (setter != Py_None) {
+        if (!(result = PyObject_Vectorcall(setter, args, 2, NULL))) {
             return -1;
         }
         Py_DECREF(result);
         return 0;
     }
-    return __PyObject_SetState__(self, arg);
+    return __PyObject_SetState__(state, self, arg, methods);
 }
 
 
@@ -114,26 +179,14 @@ __PyObject_InPlaceConcatOrAdd(PyObject *self, PyObject *arg)
 }
 
 static int
-__PyObject_Extend(PyObject *self, PyObject *arg)
+__PyObject_Extend(
+    module_state *state, PyObject *self, PyObject *arg, int methods
+)
 {
-    _Py_IDENTIFIER(extend);
-    PyObject *result = NULL;
-
-    if (
-        !(
-            result = _PyObject_CallMethodIdObjArgs(
-                self, &PyId_extend, arg, NULL
-            )
-        )
-    ) {
-        if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
-            PyErr_Clear();
-            return __PyObject_InPlaceConcatOrAdd(self, arg);
-        }
-        return -1;
+    if (methods & MSGPACK_HAS_EXTEND) {
+        return __PyObject_CallMethodOneArg(self, state->str_extend, arg);
     }
-    Py_DECREF(result);
-    return 0;
+    return __PyObject_InPlaceConcatOrAdd(self, arg);
 }
 
 
@@ -203,81 +256,155 @@ __PyObject_Merge(PyObject *self, PyObject *arg)
 }
 
 static int
-__PyObject_Update(PyObject *self, PyObject *arg)
+__PyObject_Update(
+    module_state *state, PyObject *self, PyObject *arg, int methods
+)
 {
-    _Py_IDENTIFIER(update);
-    PyObject *result = NULL;
-
-    if (
-        !(
-            result = _PyObject_CallMethodIdObjArgs(
-                self, &PyId_update, arg, NULL
-            )
-        )
-    ) {
-        if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
-            PyErr_Clear();
-            return __PyObject_Merge(self, arg);
-        }
-        return -1;
+    if (methods & MSGPACK_HAS_UPDATE) {
+        return __PyObject_CallMethodOneArg(self, state->str_update, arg);
     }
-    Py_DECREF(result);
-    return 0;
+    return __PyObject_Merge(self, arg);
 }
 
 
 // object.__new__()
-static int
-__PyCallable_Check(PyObject *arg, void *addr)
+static inline int
+__PyCallable_Check(PyObject *arg)
 {
     if (PyCallable_Check(arg)) {
-        *(PyObject **)addr = arg;
-        return 1;
+        return 0;
     }
     PyErr_Format(
         PyExc_TypeError,
         "tuple item returned by __reduce__() must be a callable, not %.200s",
         Py_TYPE(arg)->tp_name
     );
-    return 0;
+    return -1;
 }
 
-static int
-__PyCallableOrNone_Check(PyObject *arg, void *addr)
+PyObject *
+__PyObject_New(PyObject *callable, PyObject *args)
 {
-    if (arg == Py_None) {
-        *(PyObject **)addr = arg;
-        return 1;
+    if (__PyCallable_Check(callable)) {
+        return NULL;
     }
-    return __PyCallable_Check(arg, addr);
+    if (!PyTuple_Check(args)) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "tuple item returned by __reduce__() must be a tuple, not %.200s",
+            Py_TYPE(args)->tp_name
+        );
+        return NULL;
+    }
+    return PyObject_Vectorcall(
+        callable, _PyTuple_ITEMS(args), PyTuple_GET_SIZE(args), NULL
+    );
 }
 
-PyObject *
-__PyObject_New(PyObject *reduce)
+/* items are those of the reduce tuple (callable, args[, state[, listitems[,
+   dictitems[, state_setter]]]]), missing items are NULL (or None) */
+int
+__PyObject_Build(module_state *state, PyObject *self, PyObject **items)
 {
-    PyObject *callable, *args;
-    PyObject *setstatearg = Py_None, *extendarg = Py_None, *updatearg = Py_None;
-    PyObject *statesetter = Py_None;
-    PyObject *self = NULL;
+    PyObject *_items_[6];
+    int methods = 0, i;
 
+    for (i = 2; i < 6; ++i) {
+        _items_[i] = (items[i]) ? items[i] : Py_None;
+    }
     if (
-        PyArg_ParseTuple(
-            reduce, "O&O!|OOOO&",
-            __PyCallable_Check, &callable, &PyTuple_Type, &args,
-            &setstatearg, &extendarg, &updatearg,
-            __PyCallableOrNone_Check, &statesetter
-        ) &&
-        (self = PyObject_CallObject(callable, args)) &&
+        ((_items_[5] != Py_None) && __PyCallable_Check(_items_[5])) ||
+        ((methods = __PyType_Methods(state, Py_TYPE(self))) < 0) ||
         (
-            (
-                setstatearg != Py_None &&
-                __PyObject_SetState(self, setstatearg, statesetter)
-            ) ||
-            (extendarg != Py_None && __PyObject_Extend(self, extendarg)) ||
-            (updatearg != Py_None && __PyObject_Update(self, updatearg))
+            (_items_[2] != Py_None) &&
+            __PyObject_SetState(state, self, _items_[2], _items_[5], methods)
+        ) ||
+        (
+            (_items_[3] != Py_None) &&
+            __PyObject_Extend(state, self, _items_[3], methods)
+        ) ||
+        (
+            (_items_[4] != Py_None) &&
+            __PyObject_Update(state, self, _items_[4], methods)
         )
     ) {
-        Py_CLEAR(self);
+        return -1;
     }
-    return self;
+    return 0;
+}
+
+
+// object.__new__() for plain classes (see _PyInstance_Pack())
+static inline int
+__PyObject_SetSlots(PyObject *self, PyObject *slots)
+{
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject *key = NULL, *value = NULL, *descr = NULL;
+    PyMemberDef *member = NULL;
+    Py_ssize_t pos = 0;
+
+    while (PyDict_Next(slots, &pos, &key, &value)) {
+        if (
+            !PyUnicode_Check(key) ||
+            !(descr = _PyType_Lookup(type, key)) || // borrowed
+            !Py_IS_TYPE(descr, &PyMemberDescr_Type) ||
+            (
+                (member = ((PyMemberDescrObject *)descr)->d_member)->type !=
+                T_OBJECT_EX
+            )
+        ) {
+            PyErr_Format(
+                PyExc_AttributeError,
+                "'%.200s' object has no slot %R", type->tp_name, key
+            );
+            return -1;
+        }
+        if (PyMember_SetOne((char *)self, member, value)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+PyObject *
+__PyObject_NewInstance(PyObject *cls)
+{
+    PyTypeObject *type = (PyTypeObject *)cls;
+
+    if (
+        !PyType_Check(cls) ||
+        (type->tp_new != PyBaseObject_Type.tp_new) ||
+        PyType_HasFeature(type, Py_TPFLAGS_IS_ABSTRACT)
+    ) {
+        PyErr_Format(PyExc_TypeError, "cannot unpack %R instances", cls);
+        return NULL;
+    }
+    return type->tp_alloc(type, 0);
+}
+
+int
+__PyObject_InitInstance(PyObject *self, PyObject *dict, PyObject *slots)
+{
+    PyObject **dictptr = NULL;
+
+    if (PyDict_GET_SIZE(dict)) {
+        if (!(dictptr = _PyObject_GetDictPtr(self))) {
+            PyErr_Format(
+                PyExc_AttributeError,
+                "'%.200s' object has no attribute '__dict__'",
+                Py_TYPE(self)->tp_name
+            );
+            return -1;
+        }
+        if (
+            (!*dictptr && !(*dictptr = PyDict_New())) ||
+            PyDict_Update(*dictptr, dict)
+        ) {
+            return -1;
+        }
+    }
+    if (PyDict_GET_SIZE(slots) && __PyObject_SetSlots(self, slots)) {
+        return -1;
+    }
+    return 0;
 }
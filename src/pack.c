@@ -11,10 +11,6 @@
 #define _Packing_(n) _While_(packing, n)
 
 
-#define _PyBytes_FromPyByteArray(o) \
-    PyBytes_FromStringAndSize(PyByteArray_AS_STRING(o), PyByteArray_GET_SIZE(o))
-
-
 _Py_IDENTIFIER(__reduce__);
 
 
@@ -22,6 +18,14 @@ _Py_IDENTIFIER(__reduce__);
    pack
    -------------------------------------------------------------------------- */
 
+/* messages wrapping a caller supplied buffer (see PackMessageInto()) are
+   flagged with an invalid exports count, they never grow and are never
+   NUL terminated (their ob_alloc accounts for it) */
+#define _MSG_FOREIGN_ -1
+
+#define __msg_is_foreign__(self) ((self)->ob_exports == _MSG_FOREIGN_)
+
+
 static inline PyByteArrayObject *
 __msg_new__(Py_ssize_t alloc)
 {
@@ -44,6 +48,18 @@ __msg_new__(Py_ssize_t alloc)
 }
 
 
+static inline void
+__msg_wrap__(PyByteArrayObject *self, char *buffer, Py_ssize_t len)
+{
+    Py_SET_REFCNT(self, 1);
+    Py_SET_TYPE(self, &PyByteArray_Type);
+    self->ob_start = self->ob_bytes = buffer;
+    self->ob_alloc = len + 1;
+    self->ob_exports = _MSG_FOREIGN_;
+    Py_SIZE(self) = 0;
+}
+
+
 static inline int
 __msg_resize__(PyByteArrayObject *self, Py_ssize_t nalloc)
 {
@@ -51,8 +67,13 @@ __msg_resize__(PyByteArrayObject *self, Py_ssize_t nalloc)
     void *bytes = NULL;
 
     if (self->ob_alloc < nalloc) {
+        if (__msg_is_foreign__(self)) {
+            PyErr_SetString(PyExc_ValueError, "buffer too small");
+            return -1;
+        }
         alloc = Py_MAX(nalloc, (self->ob_alloc << 1));
         if (!(bytes = PyObject_Realloc(self->ob_bytes, alloc))) {
+            PyErr_NoMemory();
             return -1;
         }
         self->ob_start = self->ob_bytes = bytes;
@@ -62,17 +83,29 @@ __msg_resize__(PyByteArrayObject *self, Py_ssize_t nalloc)
 }
 
 
+static inline void
+__msg_setsize__(PyByteArrayObject *self, Py_ssize_t nsize)
+{
+    Py_SIZE(self) = nsize;
+    if (!__msg_is_foreign__(self)) {
+        self->ob_bytes[nsize] = '\0';
+    }
+}
+
+
 #define _PACK_BEGIN_ \
     size_t start = Py_SIZE(self), nsize = start + size; \
-    if ((nsize >= PY_SSIZE_T_MAX) || __msg_resize__(self, (nsize + 1))) { \
+    if (nsize >= PY_SSIZE_T_MAX) { \
         PyErr_NoMemory(); \
         return -1; \
+    } \
+    if (__msg_resize__(self, (nsize + 1))) { \
+        return -1; \
     }
 
 
 #define _PACK_END_ \
-    Py_SIZE(self) = nsize; \
-    self->ob_bytes[nsize] = '\0'; \
+    __msg_setsize__(self, nsize); \
     return 0;
 
 
@@ -137,6 +170,24 @@ __msgpack_buffers__(
 }
 
 
+/* grow the message by size bytes and return the (uninitialized) room */
+static inline char *
+__pack_reserve__(PyByteArrayObject *self, size_t size)
+{
+    size_t start = Py_SIZE(self), nsize = start + size;
+
+    if (nsize >= PY_SSIZE_T_MAX) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (__msg_resize__(self, (nsize + 1))) {
+        return NULL;
+    }
+    __msg_setsize__(self, nsize);
+    return (self->ob_bytes + start);
+}
+
+
 /* -------------------------------------------------------------------------- */
 
 static int
@@ -146,6 +197,13 @@ __pack_buffer(PyObject *msg, const void *buffer, size_t size)
 }
 
 
+static char *
+__pack_reserve(PyObject *msg, size_t size)
+{
+    return __pack_reserve__((PyByteArrayObject *)msg, size);
+}
+
+
 static int
 __msgpack_type(PyObject *msg, uint8_t type)
 {
@@ -288,51 +346,49 @@ __msgpack_bytes4(PyObject *msg, uint8_t type, const char *bytes, Py_ssize_t len)
 #define __msgpack_uint(m, s, v) __msgpack_value##s(m, MSGPACK_UINT##s, v)
 #define __msgpack_int(m, s, v) __msgpack_value##s(m, MSGPACK_INT##s, v)
 
+/* log2 of the size of the encoded value by number of significant bits, the
+   type is MSGPACK_(U)INT1 + log2(size) */
+static const uint8_t __long_widths[65] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0,                          // 0 - 8
+    1, 1, 1, 1, 1, 1, 1, 1,                             // 9 - 16
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,     // 17 - 32
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,     // 33 - 64
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3
+};
+
+
+/* value must not be a fixint */
+static inline uint8_t
+__long_width(int64_t value)
+{
+    if (value < 0) { // one more bit for the sign, ~value > 0
+        return __long_widths[65 - __builtin_clzll(~(uint64_t)value)];
+    }
+    return __long_widths[64 - __builtin_clzll((uint64_t)value)];
+}
+
+
 static inline int
 __pack_long__(PyObject *msg, int64_t value)
 {
-    int res = -1;
-
-    if (value < MSGPACK_FIXINT_MIN) {
-        if (value < MSGPACK_INT2_MIN) {
-            if (value < MSGPACK_INT4_MIN) {
-                res = __msgpack_int(msg, 8, value);
-            }
-            else {
-                res = __msgpack_int(msg, 4, value);
-            }
-        }
-        else {
-            if (value < MSGPACK_INT1_MIN) {
-                res = __msgpack_int(msg, 2, value);
-            }
-            else {
-                res = __msgpack_int(msg, 1, value);
-            }
-        }
-    }
-    else if (value < MSGPACK_FIXUINT_MAX) { // fixint
-        res = __msgpack_fixint(msg, value);
-    }
-    else {
-        if (value < MSGPACK_UINT2_MAX) {
-            if (value < MSGPACK_UINT1_MAX) {
-                res = __msgpack_uint(msg, 1, value);
-            }
-            else {
-                res = __msgpack_uint(msg, 2, value);
-            }
-        }
-        else {
-            if (value < MSGPACK_UINT4_MAX) {
-                res = __msgpack_uint(msg, 4, value);
-            }
-            else {
-                res = __msgpack_uint(msg, 8, value);
-            }
-        }
+    uint64_t bevalue = 0;
+    uint8_t width = 0, type = 0;
+    size_t size = 0;
+    char *p = NULL;
+
+    if ((MSGPACK_FIXINT_MIN <= value) && (value < MSGPACK_FIXUINT_MAX)) {
+        return __msgpack_fixint(msg, value);
+    }
+    width = __long_width(value);
+    type = ((value < 0) ? MSGPACK_INT1 : MSGPACK_UINT1) + width;
+    size = 1 << width;
+    if (!(p = __pack_reserve(msg, (1 + size)))) {
+        return -1;
     }
-    return res;
+    bevalue = htobe64((uint64_t)value);
+    p[0] = type;
+    memcpy((p + 1), ((char *)&bevalue + (8 - size)), size);
+    return 0;
 }
 
 static inline int
@@ -419,6 +475,251 @@ __pack_unicode(PyObject *msg, const char *bytes, Py_ssize_t len)
 }
 
 
+static inline int
+__pack_unicode_header(PyObject *msg, Py_ssize_t len)
+{
+    int res = -1;
+
+    if (len < MSGPACK_FIXSTR_MAX) { // fixstr
+        res = __msgpack_type(msg, (MSGPACK_FIXSTR | len));
+    }
+    else if (len < MSGPACK_UINT1_MAX) {
+        res = __msgpack_value1(msg, MSGPACK_STR1, len);
+    }
+    else if (len < MSGPACK_UINT2_MAX) {
+        res = __msgpack_value2(msg, MSGPACK_STR2, len);
+    }
+    else if (len < MSGPACK_UINT4_MAX) {
+        res = __msgpack_value4(msg, MSGPACK_STR4, len);
+    }
+    else {
+        _PyErr_ObjTooBig_("str", 0);
+    }
+    return res;
+}
+
+
+/* utf-8 transcoding -------------------------------------------------------- */
+
+/* non-ascii str objects are encoded straight from their canonical (UCS1,
+   UCS2 or UCS4) data so that packing them does not attach a (cached) utf-8
+   copy to them, the length of the encoded data is computed first to size
+   the header, it is -1 if the str holds surrogates (not encodable) */
+
+#define __utf8_length__(T) \
+    static inline Py_ssize_t \
+    __utf8_length_##T(const T *data, Py_ssize_t len) \
+    { \
+        Py_ssize_t size = len, i; \
+        Py_UCS4 ch; \
+        \
+        for (i = 0; i < len; ++i) { \
+            if ((ch = data[i]) >= 0x80) { \
+                if (ch < 0x800) { \
+                    size += 1; \
+                } \
+                else if (ch < 0x10000) { \
+                    if (Py_UNICODE_IS_SURROGATE(ch)) { \
+                        return -1; \
+                    } \
+                    size += 2; \
+                } \
+                else { \
+                    size += 3; \
+                } \
+            } \
+        } \
+        return size; \
+    }
+
+
+#define __utf8_encode__(T) \
+    static inline void \
+    __utf8_encode_##T(char *p, const T *data, Py_ssize_t len) \
+    { \
+        Py_ssize_t i; \
+        Py_UCS4 ch; \
+        \
+        for (i = 0; i < len; ++i) { \
+            if ((ch = data[i]) < 0x80) { \
+                *p++ = (char)ch; \
+            } \
+            else if (ch < 0x800) { \
+                *p++ = (char)(0xc0 | (ch >> 6)); \
+                *p++ = (char)(0x80 | (ch & 0x3f)); \
+            } \
+            else if (ch < 0x10000) { \
+                *p++ = (char)(0xe0 | (ch >> 12)); \
+                *p++ = (char)(0x80 | ((ch >> 6) & 0x3f)); \
+                *p++ = (char)(0x80 | (ch & 0x3f)); \
+            } \
+            else { \
+                *p++ = (char)(0xf0 | (ch >> 18)); \
+                *p++ = (char)(0x80 | ((ch >> 12) & 0x3f)); \
+                *p++ = (char)(0x80 | ((ch >> 6) & 0x3f)); \
+                *p++ = (char)(0x80 | (ch & 0x3f)); \
+            } \
+        } \
+    }
+
+
+__utf8_length__(Py_UCS1)
+__utf8_length__(Py_UCS2)
+__utf8_length__(Py_UCS4)
+
+__utf8_encode__(Py_UCS1)
+__utf8_encode__(Py_UCS2)
+__utf8_encode__(Py_UCS4)
+
+
+static inline Py_ssize_t
+__utf8_length(PyObject *obj)
+{
+    const void *data = PyUnicode_DATA(obj);
+    Py_ssize_t len = PyUnicode_GET_LENGTH(obj);
+
+    switch (PyUnicode_KIND(obj)) {
+        case PyUnicode_1BYTE_KIND:
+            return __utf8_length_Py_UCS1(data, len);
+        case PyUnicode_2BYTE_KIND:
+            return __utf8_length_Py_UCS2(data, len);
+        default:
+            return __utf8_length_Py_UCS4(data, len);
+    }
+}
+
+
+static inline void
+__utf8_encode(char *p, PyObject *obj)
+{
+    const void *data = PyUnicode_DATA(obj);
+    Py_ssize_t len = PyUnicode_GET_LENGTH(obj);
+
+    switch (PyUnicode_KIND(obj)) {
+        case PyUnicode_1BYTE_KIND:
+            __utf8_encode_Py_UCS1(p, data, len);
+            break;
+        case PyUnicode_2BYTE_KIND:
+            __utf8_encode_Py_UCS2(p, data, len);
+            break;
+        default:
+            __utf8_encode_Py_UCS4(p, data, len);
+            break;
+    }
+}
+
+
+/* the utf-8 representation of obj if it is readily available (ascii data or
+   already cached), NULL otherwise */
+static inline const char *
+__utf8_cached(PyObject *obj, Py_ssize_t *len)
+{
+    if (PyUnicode_IS_ASCII(obj)) {
+        *len = PyUnicode_GET_LENGTH(obj);
+        return PyUnicode_DATA(obj);
+    }
+    if (
+        PyUnicode_IS_COMPACT(obj) &&
+        ((PyCompactUnicodeObject *)obj)->utf8
+    ) {
+        *len = ((PyCompactUnicodeObject *)obj)->utf8_length;
+        return ((PyCompactUnicodeObject *)obj)->utf8;
+    }
+    return NULL;
+}
+
+
+/* memo --------------------------------------------------------------------- */
+
+/* open addressing (linear probing) table keyed on the address of the
+   containers and reduced objects packed so far, their index is their rank in
+   packing order (the order in which they are memoized when unpacking) */
+
+#define MSGPACK_MEMO_MIN_SIZE 16
+
+
+static inline memo_entry *
+__memo_lookup(memo_entry *entries, Py_ssize_t mask, PyObject *obj)
+{
+    memo_entry *entry = NULL;
+    size_t i = (size_t)_Py_HashPointer(obj) & mask;
+
+    for (;; i = ((i + 1) & mask)) {
+        entry = &entries[i];
+        if (!entry->obj || (entry->obj == obj)) {
+            return entry;
+        }
+    }
+}
+
+
+static int
+__memo_resize(memo_table *memo)
+{
+    Py_ssize_t alloc = 0, i;
+    memo_entry *entries = NULL, *old = NULL;
+
+    alloc = (memo->mask) ? ((memo->mask + 1) << 1) : MSGPACK_MEMO_MIN_SIZE;
+    if (!(entries = PyMem_Calloc(alloc, sizeof(memo_entry)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (memo->entries) {
+        for (i = 0; i <= memo->mask; ++i) {
+            if ((old = &memo->entries[i])->obj) {
+                *__memo_lookup(entries, (alloc - 1), old->obj) = *old;
+            }
+        }
+        PyMem_Free(memo->entries);
+    }
+    memo->entries = entries;
+    memo->mask = alloc - 1;
+    return 0;
+}
+
+
+/* returns -1 if obj is not memoized */
+static inline Py_ssize_t
+__memo_get(memo_table *memo, PyObject *obj)
+{
+    memo_entry *entry = NULL;
+
+    if (!memo->size) {
+        return -1;
+    }
+    entry = __memo_lookup(memo->entries, memo->mask, obj);
+    return (entry->obj) ? entry->index : -1;
+}
+
+
+/* a no-op unless packing in memo mode */
+static inline int
+__memo_put(pack_context *context, PyObject *obj)
+{
+    memo_table *memo = &context->memo;
+    memo_entry *entry = NULL;
+
+    if (!(context->flags & MSGPACK_PACK_MEMO)) {
+        return 0;
+    }
+    // keep the load factor under 2/3
+    if (
+        (((memo->size + 1) * 3) > ((memo->mask + 1) * 2)) &&
+        __memo_resize(memo)
+    ) {
+        return -1;
+    }
+    entry = __memo_lookup(memo->entries, memo->mask, obj);
+    if (!entry->obj) {
+        entry->obj = Py_NewRef(obj); // keeps its address from being reused
+    }
+    // a tuple (or frozenset) can be packed again while it is packed (through
+    // a mutable item), each copy gets its own index as when unpacking
+    entry->index = memo->size++;
+    return 0;
+}
+
+
 /* array -------------------------------------------------------------------- */
 
 #define __msgpack_fixarray(m, l) __msgpack_type(m, (MSGPACK_FIXARRAY | l))
@@ -449,7 +750,7 @@ __pack_array(PyObject *msg, Py_ssize_t len, const char *name)
 
 static inline int
 __pack_sequence__(
-    PyObject *module,
+    pack_context *context,
     PyObject *msg,
     PyObject **items,
     Py_ssize_t len,
@@ -463,7 +764,7 @@ __pack_sequence__(
     if (!Py_EnterRecursiveCall(where)) {
         if (!__pack_array(msg, len, name)) {
             for (res = 0, i = 0; i < len; ++i) {
-                if ((res = PackObject(module, msg, items[i]))) {
+                if ((res = PackObject(context, msg, items[i]))) {
                     break;
                 }
             }
@@ -473,8 +774,8 @@ __pack_sequence__(
     return res;
 }
 
-#define __pack_sequence(_mod_, m, i, l, n) \
-    __pack_sequence__(_mod_, m, i, l, n, _Packing_(n))
+#define __pack_sequence(_ctx_, m, i, l, n) \
+    __pack_sequence__(_ctx_, m, i, l, n, _Packing_(n))
 
 
 /* dict --------------------------------------------------------------------- */
@@ -503,7 +804,7 @@ __pack_map(PyObject *msg, Py_ssize_t len)
 }
 
 static inline int
-__pack_dict(PyObject *module, PyObject *msg, PyObject *obj)
+__pack_dict(pack_context *context, PyObject *msg, PyObject *obj)
 {
     Py_ssize_t pos = 0;
     PyObject *key = NULL, *val = NULL;
@@ -512,8 +813,8 @@ __pack_dict(PyObject *module, PyObject *msg, PyObject *obj)
     if (!Py_EnterRecursiveCall(_Packing_("dict"))) {
         if (!__pack_map(msg, PyDict_GET_SIZE(obj))) {
             while ((res = PyDict_Next(obj, &pos, &key, &val))) {
-                if ((res = PackObject(module, msg, key)) ||
-                    (res = PackObject(module, msg, val))) {
+                if ((res = PackObject(context, msg, key)) ||
+                    (res = PackObject(context, msg, val))) {
                     break;
                 }
             }
@@ -533,12 +834,43 @@ __pack_dict(PyObject *module, PyObject *msg, PyObject *obj)
 
 /* PyLong ------------------------------------------------------------------- */
 
+/* small ints (up to 2 digits) are read directly */
+static inline int
+__long_compact(PyObject *obj, int64_t *value)
+{
+    const digit *digits = ((PyLongObject *)obj)->ob_digit;
+
+    switch (Py_SIZE(obj)) {
+        case 0:
+            *value = 0;
+            return 1;
+        case 1:
+            *value = digits[0];
+            return 1;
+        case -1:
+            *value = -(int64_t)digits[0];
+            return 1;
+        case 2:
+            *value = digits[0] | ((int64_t)digits[1] << PyLong_SHIFT);
+            return 1;
+        case -2:
+            *value = -(digits[0] | ((int64_t)digits[1] << PyLong_SHIFT));
+            return 1;
+    }
+    return 0;
+}
+
+
 static int
 _PyLong_Pack(PyObject *msg, PyObject *obj)
 {
     int overflow = 0;
-    int64_t value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    int64_t value = 0;
 
+    if (__long_compact(obj, &value)) {
+        return __pack_long__(msg, value);
+    }
+    value = PyLong_AsLongLongAndOverflow(obj, &overflow);
     if (overflow) {
         if (overflow < 0) {
             _PyErr_ObjTooBig_("int", 0);
@@ -577,35 +909,63 @@ static int
 _PyUnicode_Pack(PyObject *msg, PyObject *obj)
 {
     const char *bytes = NULL;
+    char *p = NULL;
     Py_ssize_t len;
 
-    if (!(bytes = PyUnicode_AsUTF8AndSize(obj, &len))) {
+    if (PyUnicode_READY(obj)) {
+        return -1;
+    }
+    if (
+        !(bytes = __utf8_cached(obj, &len)) &&
+        (!PyUnicode_IS_COMPACT(obj) || ((len = __utf8_length(obj)) < 0))
+    ) {
+        // legacy str or surrogates, let the codec deal with it (or fail)
+        if (!(bytes = PyUnicode_AsUTF8AndSize(obj, &len))) {
+            return -1;
+        }
+    }
+    if (bytes) {
+        return __pack_unicode(msg, bytes, len);
+    }
+    if (
+        __pack_unicode_header(msg, len) ||
+        !(p = __pack_reserve(msg, len))
+    ) {
         return -1;
     }
-    return __pack_unicode(msg, bytes, len);
+    __utf8_encode(p, obj);
+    return 0;
 }
 
 
 /* PyTuple ------------------------------------------------------------------ */
 
-#define __pack_tuple(_mod_, m, i, l) __pack_sequence(_mod_, m, i, l, "tuple")
+#define __pack_tuple(_ctx_, m, i, l) __pack_sequence(_ctx_, m, i, l, "tuple")
 
+/* immutable containers are memoized once packed, they cannot be referenced
+   while they are unpacked */
 static int
-_PyTuple_Pack(PyObject *module, PyObject *msg, PyObject *obj)
+_PyTuple_Pack(pack_context *context, PyObject *msg, PyObject *obj)
 {
     PyObject **items = _PyTuple_ITEMS(obj);
     Py_ssize_t len = PyTuple_GET_SIZE(obj);
 
-    return __pack_tuple(module, msg, items, len);
+    if (__pack_tuple(context, msg, items, len)) {
+        return -1;
+    }
+    return __memo_put(context, obj);
 }
 
 
 /* PyDict ------------------------------------------------------------------- */
 
 static int
-_PyDict_Pack(PyObject *module, PyObject *msg, PyObject *obj)
+_PyDict_Pack(pack_context *context, PyObject *msg, PyObject *obj)
 {
-    return __pack_dict(module, msg, obj);
+    if (__memo_put(context, obj)) {
+        return -1;
+    }
+    return __pack_dict(context, msg, obj);
 }
 
 
@@ -665,410 +1025,2040 @@ __pack_extension(PyObject *msg, PyObject *data, uint8_t type, const char *name)
 }
 
 
-/* anyset ------------------------------------------------------------------- */
+/* in place extensions ------------------------------------------------------ */
+
+/* The payload of an extension whose size is not known in advance is packed
+   directly after a reserved MSGPACK_EXT1 header, the header is then written
+   back with the narrowest form once the size is known (moving the payload
+   only when the reserved width was wrong). Foreign messages only reserve the
+   narrowest header (MSGPACK_FIXEXT*) so that headers only ever grow, what is
+   written never exceeds the final (precomputed) size of the message. */
+
+#define MSGPACK_EXT_RESERVED 3 // MSGPACK_EXT1 header
+#define MSGPACK_EXT_RESERVED_MIN 2 // MSGPACK_FIXEXT* header
+
+#define __msg_ext_reserved__(self) \
+    ( \
+        (__msg_is_foreign__(self)) ? \
+        MSGPACK_EXT_RESERVED_MIN : MSGPACK_EXT_RESERVED \
+    )
+
 
 static inline int
-__pack_anyset__(
-    PyObject *module,
-    PyObject *msg,
-    PyObject *obj,
-    const char *name,
-    const char *where
-)
+__pack_ext_header(char *header, Py_ssize_t len, uint8_t type, const char *name)
 {
-    Py_ssize_t pos = 0;
-    PyObject *item = NULL;
-    Py_hash_t hash;
-    int res = -1;
+    uint16_t belen2;
+    uint32_t belen4;
+    int size = -1;
 
-    if (!Py_EnterRecursiveCall(where)) {
-        if (!__pack_array(msg, PySet_GET_SIZE(obj), name)) {
-            while ((res = _PySet_NextEntry(obj, &pos, &item, &hash))) {
-                if ((res = PackObject(module, msg, item))) {
-                    break;
-                }
-            }
+    if (len < MSGPACK_UINT1_MAX) {
+        switch (len) {
+            case 1:
+                header[0] = MSGPACK_FIXEXT1;
+                break;
+            case 2:
+                header[0] = MSGPACK_FIXEXT2;
+                break;
+            case 4:
+                header[0] = MSGPACK_FIXEXT4;
+                break;
+            case 8:
+                header[0] = MSGPACK_FIXEXT8;
+                break;
+            case 16:
+                header[0] = MSGPACK_FIXEXT16;
+                break;
+            default:
+                header[0] = MSGPACK_EXT1;
+                header[1] = (uint8_t)len;
+                header[2] = type;
+                return 3;
         }
-        Py_LeaveRecursiveCall();
+        header[1] = type;
+        size = 2;
     }
-    return res;
+    else if (len < MSGPACK_UINT2_MAX) {
+        belen2 = htobe16(len);
+        header[0] = MSGPACK_EXT2;
+        memcpy((header + 1), &belen2, 2);
+        header[3] = type;
+        size = 4;
+    }
+    else if (len < MSGPACK_UINT4_MAX) {
+        belen4 = htobe32(len);
+        header[0] = MSGPACK_EXT4;
+        memcpy((header + 1), &belen4, 4);
+        header[5] = type;
+        size = 6;
+    }
+    else {
+        _PyErr_ObjTooBig_(name, 1);
+    }
+    return size;
 }
 
-#define __pack_anyset(_mod_, m, o, n) \
-    __pack_anyset__(_mod_, m, o, n, _Packing_(n))
 
+static inline int
+__pack_ext_reserve__(PyByteArrayObject *self, Py_ssize_t *pos)
+{
+    const size_t size = __msg_ext_reserved__(self);
 
-/* class -------------------------------------------------------------------- */
+    _PACK_BEGIN_
 
-static PyObject *
-__pack_class(PyObject *obj)
-{
-    _Py_IDENTIFIER(__module__);
-    _Py_IDENTIFIER(__qualname__);
-    PyObject *data = NULL, *_modname_ = NULL, *_qualname_ = NULL;
+    *pos = start;
 
-    if (
-        (_modname_ = _PyObject_GetAttrId(obj, &PyId___module__)) &&
-        (_qualname_ = _PyObject_GetAttrId(obj, &PyId___qualname__))
-    ) {
-        if (
-            !PyUnicode_CheckExact(_modname_) ||
-            !PyUnicode_CheckExact(_qualname_)
-        ) {
-            PyErr_Format(
-                PyExc_TypeError,
-                "expected strings, got: __module__: %.200s, __qualname__: %.200s",
-                Py_TYPE(_modname_)->tp_name,
-                Py_TYPE(_qualname_)->tp_name
-            );
+    _PACK_END_
+}
+
+static inline int
+__pack_ext_backpatch__(
+    PyByteArrayObject *self, Py_ssize_t pos, uint8_t type, const char *name
+)
+{
+    Py_ssize_t reserved = __msg_ext_reserved__(self);
+    Py_ssize_t data = pos + reserved;
+    Py_ssize_t len = Py_SIZE(self) - data;
+    Py_ssize_t nsize = 0;
+    char header[6];
+    int size = -1;
+
+    if ((size = __pack_ext_header(header, len, type, name)) < 0) {
+        return -1;
+    }
+    if (size != reserved) {
+        nsize = pos + size + len;
+        if (nsize >= PY_SSIZE_T_MAX) {
+            PyErr_NoMemory();
+            return -1;
         }
-        else if (
-            (data = NewMessage()) &&
-            (
-                _PyUnicode_Pack(data, _modname_) ||
-                _PyUnicode_Pack(data, _qualname_)
-            )
-        ) {
-            Py_CLEAR(data);
+        if (__msg_resize__(self, (nsize + 1))) {
+            return -1;
         }
+        memmove(
+            (self->ob_bytes + pos + size), (self->ob_bytes + data), len
+        );
+        __msg_setsize__(self, nsize);
     }
-    Py_XDECREF(_qualname_);
-    Py_XDECREF(_modname_);
-    return data;
+    memcpy((self->ob_bytes + pos), header, size);
+    return 0;
 }
 
 
-/* singleton ---------------------------------------------------------------- */
-
-static PyObject *
-__pack_singleton(PyObject *obj)
+static inline int
+__pack_ext_reserve(PyObject *msg, Py_ssize_t *pos)
 {
-    PyObject *data = NULL, *reduce = NULL;
+    return __pack_ext_reserve__((PyByteArrayObject *)msg, pos);
+}
 
-    if ((reduce = _PyObject_CallMethodId(obj, &PyId___reduce__, NULL))) {
-        if (!PyUnicode_CheckExact(reduce)) {
-            PyErr_SetString(PyExc_TypeError, "__reduce__() must return a str");
-        }
-        else if (
-            (data = NewMessage()) &&
-            _PyUnicode_Pack(data, reduce)
-        ) {
-            Py_CLEAR(data);
-        }
-        Py_DECREF(reduce);
-    }
-    return data;
+static inline int
+__pack_ext_backpatch(
+    PyObject *msg, Py_ssize_t pos, uint8_t type, const char *name
+)
+{
+    return __pack_ext_backpatch__((PyByteArrayObject *)msg, pos, type, name);
 }
 
 
-/* complex ------------------------------------------------------------------ */
+/* references ------------------------------------------------------------- */
 
+static inline Py_ssize_t
+__ref_size(Py_ssize_t index)
+{
+    if (index < MSGPACK_UINT1_MAX) {
+        return 3;
+    }
+    else if (index < MSGPACK_UINT2_MAX) {
+        return 4;
+    }
+    return 6;
+}
+
+
+static int
+__pack_ref(PyObject *msg, Py_ssize_t index, uint8_t type, const char *name)
+{
+    int res = -1;
+
+    if (index < MSGPACK_UINT1_MAX) {
+        if (!(res = __pack_ext(msg, 1, name))) {
+            res = __msgpack_value1(msg, type, index);
+        }
+    }
+    else if (index < MSGPACK_UINT2_MAX) {
+        if (!(res = __pack_ext(msg, 2, name))) {
+            res = __msgpack_value2(msg, type, index);
+        }
+    }
+    else if (index < MSGPACK_UINT4_MAX) {
+        if (!(res = __pack_ext(msg, 4, name))) {
+            res = __msgpack_value4(msg, type, index);
+        }
+    }
+    else {
+        _PyErr_ObjTooBig_(name, 0);
+    }
+    return res;
+}
+
+
+/* dictionary --------------------------------------------------------------- */
+
+/* returns 1 if there is no dictionary or obj is not in it */
+static int
+__pack_dictionary_ref(pack_context *context, PyObject *msg, PyObject *obj)
+{
+    Py_ssize_t index = -1;
+
+    if (!context->dictionary) {
+        return 1;
+    }
+    if ((index = DictionaryIndex((Dictionary *)context->dictionary, obj)) < 0) {
+        return (index == -1) ? 1 : -1;
+    }
+    return __pack_ref(
+        msg, index, MSGPACK_EXT_PYDICTREF, "dictionary reference"
+    );
+}
+
+
+/* strings ------------------------------------------------------------------ */
+
+/* With MSGPACK_PACK_STRINGS every str packed as such gets an index (on both
+   ends), a str met again is packed as a reference to it when that is shorter
+   (only strs of at least MSGPACK_STRING_MIN code points are looked up). strs
+   found in the dictionary are always packed as a reference to it instead. */
+
+#define MSGPACK_STRING_MIN 3
+
+
+static int
+__pack_string(pack_context *context, PyObject *msg, PyObject *obj)
+{
+    PyObject *index = NULL;
+    Py_ssize_t len = PyUnicode_GET_LENGTH(obj), i = 0;
+    int res = -1;
+
+    if ((res = __pack_dictionary_ref(context, msg, obj)) <= 0) {
+        return res;
+    }
+    if (!context->strings) {
+        return _PyUnicode_Pack(msg, obj);
+    }
+    if (len >= MSGPACK_STRING_MIN) {
+        // borrowed
+        if ((index = PyDict_GetItemWithError(context->strings, obj))) {
+            if (((i = PyLong_AsSsize_t(index)) == -1) && PyErr_Occurred()) {
+                return -1;
+            }
+            if (__ref_size(i) <= len) {
+                return __pack_ref(
+                    msg, i, MSGPACK_EXT_PYSTRREF, "string reference"
+                );
+            }
+        }
+        else if (PyErr_Occurred()) {
+            return -1;
+        }
+        else if (
+            !(index = PyLong_FromSsize_t(context->nstrings)) ||
+            PyDict_SetItem(context->strings, obj, index)
+        ) {
+            Py_XDECREF(index);
+            return -1;
+        }
+        else {
+            Py_DECREF(index);
+        }
+    }
+    if (_PyUnicode_Pack(msg, obj)) {
+        return -1;
+    }
+    context->nstrings++;
+    return 0;
+}
+
+
+/* anyset ------------------------------------------------------------------- */
+
+static inline int
+__pack_anyset__(
+    pack_context *context,
+    PyObject *msg,
+    PyObject *obj,
+    const char *name,
+    const char *where
+)
+{
+    Py_ssize_t pos = 0;
+    PyObject *item = NULL;
+    Py_hash_t hash;
+    int res = -1;
+
+    if (!Py_EnterRecursiveCall(where)) {
+        if (!__pack_array(msg, PySet_GET_SIZE(obj), name)) {
+            while ((res = _PySet_NextEntry(obj, &pos, &item, &hash))) {
+                if ((res = PackObject(context, msg, item))) {
+                    break;
+                }
+            }
+        }
+        Py_LeaveRecursiveCall();
+    }
+    return res;
+}
+
+#define __pack_anyset(_ctx_, m, o, n) \
+    __pack_anyset__(_ctx_, m, o, n, _Packing_(n))
+
+
+/* class -------------------------------------------------------------------- */
+
+static int
+__pack_class__(PyObject *msg, PyObject *obj)
+{
+    _Py_IDENTIFIER(__module__);
+    _Py_IDENTIFIER(__qualname__);
+    PyObject *_modname_ = NULL, *_qualname_ = NULL;
+    int res = -1;
+
+    if (
+        (_modname_ = _PyObject_GetAttrId(obj, &PyId___module__)) &&
+        (_qualname_ = _PyObject_GetAttrId(obj, &PyId___qualname__))
+    ) {
+        if (
+            !PyUnicode_CheckExact(_modname_) ||
+            !PyUnicode_CheckExact(_qualname_)
+        ) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "expected strings, got: __module__: %.200s, __qualname__: %.200s",
+                Py_TYPE(_modname_)->tp_name,
+                Py_TYPE(_qualname_)->tp_name
+            );
+        }
+        else if (
+            !_PyUnicode_Pack(msg, _modname_) &&
+            !_PyUnicode_Pack(msg, _qualname_)
+        ) {
+            res = 0;
+        }
+    }
+    Py_XDECREF(_qualname_);
+    Py_XDECREF(_modname_);
+    return res;
+}
+
+static PyObject *
+__pack_class(PyObject *obj)
+{
+    PyObject *data = NULL;
+
+    if ((data = NewMessage()) && __pack_class__(data, obj)) {
+        Py_CLEAR(data);
+    }
+    return data;
+}
+
+
+/* singleton ---------------------------------------------------------------- */
+
+static int
+__pack_singleton__(PyObject *msg, PyObject *obj)
+{
+    PyObject *reduce = NULL;
+    int res = -1;
+
+    if ((reduce = _PyObject_CallMethodId(obj, &PyId___reduce__, NULL))) {
+        if (!PyUnicode_CheckExact(reduce)) {
+            PyErr_SetString(PyExc_TypeError, "__reduce__() must return a str");
+        }
+        else {
+            res = _PyUnicode_Pack(msg, reduce);
+        }
+        Py_DECREF(reduce);
+    }
+    return res;
+}
+
+static PyObject *
+__pack_singleton(PyObject *obj)
+{
+    PyObject *data = NULL;
+
+    if ((data = NewMessage()) && __pack_singleton__(data, obj)) {
+        Py_CLEAR(data);
+    }
+    return data;
+}
+
+
+/* complex ------------------------------------------------------------------ */
+
+static inline int
+__pack_complex(PyObject *msg, PyObject *obj)
+{
+    Py_complex complex = ((PyComplexObject *)obj)->cval;
+
+    if (__pack_float8(msg, complex.real) || __pack_float8(msg, complex.imag)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/* timestamp ---------------------------------------------------------------- */
+
+static inline int
+__pack_timestamp__(PyObject *msg, uint64_t seconds, uint32_t nanoseconds)
+{
+    uint64_t value = 0;
+
+    if ((seconds >> 34) == 0) {
+        value = (((uint64_t)nanoseconds << 34) | seconds);
+        if ((value & 0xffffffff00000000L) == 0) {
+            return __pack_value4(msg, (uint32_t)value);
+        }
+        return __pack_value8(msg, value);
+    }
+    return (__pack_value4(msg, nanoseconds)) ? -1 : __pack_value8(msg, seconds);
+}
+
+static inline Py_ssize_t
+__timestamp_size(uint64_t seconds, uint32_t nanoseconds)
+{
+    if ((seconds >> 34) == 0) {
+        if (((((uint64_t)nanoseconds << 34) | seconds) >> 32) == 0) {
+            return 4;
+        }
+        return 8;
+    }
+    return 12;
+}
+
+static inline int
+__pack_timestamp(PyObject *msg, PyObject *obj, const char *name)
+{
+    Timestamp *timestamp = (Timestamp *)obj;
+    Py_ssize_t size = __timestamp_size(
+        timestamp->seconds, timestamp->nanoseconds
+    );
+
+    if (
+        __pack_ext(msg, size, name) ||
+        __msgpack_type(msg, MSGPACK_EXT_TIMESTAMP)
+    ) {
+        return -1;
+    }
+    return __pack_timestamp__(msg, timestamp->seconds, timestamp->nanoseconds);
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+static inline int
+__pack_ext_sequence__(
+    pack_context *context,
+    PyObject *msg,
+    PyObject **items,
+    Py_ssize_t len,
+    uint8_t type,
+    const char *name,
+    const char *where
+)
+{
+    Py_ssize_t pos = 0;
+
+    if (
+        __pack_ext_reserve(msg, &pos) ||
+        __pack_sequence__(context, msg, items, len, name, where)
+    ) {
+        return -1;
+    }
+    return __pack_ext_backpatch(msg, pos, type, name);
+}
+
+#define __pack_ext_sequence(_ctx_, m, i, l, t, n) \
+    __pack_ext_sequence__(_ctx_, m, i, l, t, n, _Packing_(n))
+
+
+static inline int
+__pack_ext_anyset__(
+    pack_context *context,
+    PyObject *msg,
+    PyObject *obj,
+    uint8_t type,
+    const char *name,
+    const char *where
+)
+{
+    Py_ssize_t pos = 0;
+
+    if (
+        __pack_ext_reserve(msg, &pos) ||
+        __pack_anyset__(context, msg, obj, name, where)
+    ) {
+        return -1;
+    }
+    return __pack_ext_backpatch(msg, pos, type, name);
+}
+
+#define __pack_ext_anyset(_ctx_, m, o, t, n) \
+    __pack_ext_anyset__(_ctx_, m, o, t, n, _Packing_(n))
+
+
+/* PyList ------------------------------------------------------------------- */
+
+#define __pack_ext_list(_ctx_, m, i, l) \
+    __pack_ext_sequence(_ctx_, m, i, l, MSGPACK_EXT_PYLIST, "list")
+
+static int
+_PyList_Pack(pack_context *context, PyObject *msg, PyObject *obj)
+{
+    PyObject **items = _PyList_ITEMS(obj);
+    Py_ssize_t len = PyList_GET_SIZE(obj);
+
+    if (__memo_put(context, obj)) {
+        return -1;
+    }
+    return __pack_ext_list(context, msg, items, len);
+}
+
+
+/* PySet -------------------------------------------------------------------- */
+
+#define __pack_ext_set(_ctx_, m, o) \
+    __pack_ext_anyset(_ctx_, m, o, MSGPACK_EXT_PYSET, "set")
+
+static int
+_PySet_Pack(pack_context *context, PyObject *msg, PyObject *obj)
+{
+    if (__memo_put(context, obj)) {
+        return -1;
+    }
+    return __pack_ext_set(context, msg, obj);
+}
+
+
+/* PyFrozenSet -------------------------------------------------------------- */
+
+#define __pack_ext_frozenset(_ctx_, m, o) \
+    __pack_ext_anyset(_ctx_, m, o, MSGPACK_EXT_PYFROZENSET, "frozenset")
+
+static int
+_PyFrozenSet_Pack(pack_context *context, PyObject *msg, PyObject *obj)
+{
+    if (__pack_ext_frozenset(context, msg, obj)) {
+        return -1;
+    }
+    return __memo_put(context, obj);
+}
+
+
+/* PyByteArray -------------------------------------------------------------- */
+
+#define __pack_ext_bytearray(m, d) \
+    __pack_extension(m, d, MSGPACK_EXT_PYBYTEARRAY, "bytearray")
+
+
+static int
+_PyByteArray_Pack(PyObject *msg, PyObject *obj)
+{
+    return __pack_ext_bytearray(msg, obj);
+}
+
+
+/* PyArray, PyMemoryView ---------------------------------------------------- */
+
+/* the contents of C contiguous buffers with a native numeric format are
+   copied as is (in native byte order) after the typed array header */
+
+static inline int
+__typed_view(PyObject *obj, Py_buffer *view, const char *name)
+{
+    const char *format = NULL;
+
+    if (PyObject_GetBuffer(obj, view, (PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))) {
+        return -1;
+    }
+    if (*(format = (view->format) ? view->format : "B") == '@') {
+        format++;
+    }
+    if (
+        !format[0] || format[1] ||
+        !strchr(MSGPACK_TYPED_TYPECODES, format[0])
+    ) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "cannot pack '%.200s' objects with format '%.200s'",
+            name, view->format
+        );
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return format[0];
+}
+
+
+static int
+__pack_typed(PyObject *msg, PyObject *obj, uint8_t type, const char *name)
+{
+    Py_buffer view;
+    char header[MSGPACK_TYPED_HEADER];
+    int typecode = 0, res = -1;
+
+    if ((typecode = __typed_view(obj, &view, name)) < 0) {
+        return -1;
+    }
+    header[0] = (char)typecode;
+    header[1] = (char)view.itemsize;
+    header[2] = MSGPACK_TYPED_BYTEORDER;
+    if (!__pack_ext(msg, (MSGPACK_TYPED_HEADER + view.len), name)) {
+        res = __msgpack_buffers(
+            msg, type, header, MSGPACK_TYPED_HEADER, view.buf, view.len
+        );
+    }
+    PyBuffer_Release(&view);
+    return res;
+}
+
+
+#define __pack_ext_array(m, o) \
+    __pack_typed(m, o, MSGPACK_EXT_PYARRAY, "array.array")
+
+static int
+_PyArray_Pack(PyObject *msg, PyObject *obj)
+{
+    return __pack_ext_array(msg, obj);
+}
+
+
+#define __pack_ext_memoryview(m, o) \
+    __pack_typed(m, o, MSGPACK_EXT_PYMEMORYVIEW, "memoryview")
+
+static int
+_PyMemoryView_Pack(PyObject *msg, PyObject *obj)
+{
+    return __pack_ext_memoryview(msg, obj);
+}
+
+
+/* PyClass ------------------------------------------------------------------ */
+
+/* the packed representation of classes is cached per type, an entry is only
+   valid as long as the type's version tag is (the type is not referenced, a
+   new type at the same address gets a new tag) */
+
+#define __class_cache_index(t) \
+    (((uintptr_t)(t) >> 4) & (MSGPACK_CLASS_CACHE_SIZE - 1))
+
+
+static inline int
+__class_cache_version(module_state *state, PyTypeObject *type)
+{
+    if (!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+        // a method cache lookup assigns a version tag
+        _PyType_Lookup(type, state->str_module);
+        if (!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* a class is plain if it doesn't override object.__new__() nor the reduce
+   protocol, its instances are then packed natively (see _PyInstance_Pack()) */
+static inline int
+__class_is_plain(module_state *state, PyTypeObject *type)
+{
+    PyObject *names[] = {
+        state->str_reduce,
+        state->str_reduce_ex,
+        state->str_getstate,
+        state->str_setstate,
+        state->str_getnewargs,
+        state->str_getnewargs_ex
+    };
+    size_t i;
+
+    if (
+        !PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE) ||
+        (type->tp_new != PyBaseObject_Type.tp_new) ||
+        type->tp_itemsize
+    ) {
+        return 0;
+    }
+    for (i = 0; i < Py_ARRAY_LENGTH(names); ++i) {
+        if (
+            _PyType_Lookup(type, names[i]) !=
+            _PyType_Lookup(&PyBaseObject_Type, names[i])
+        ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* returns -1 if type has no id, -2 on error */
+static inline Py_ssize_t
+__class_id(module_state *state, PyTypeObject *type)
+{
+    PyObject *id = NULL;
+
+    if (
+        !(id = PyDict_GetItemWithError(state->class_ids, (PyObject *)type))
+    ) { // borrowed
+        return PyErr_Occurred() ? -2 : -1;
+    }
+    return PyLong_AsSsize_t(id); // checked by RegisterClassId()
+}
+
+
+/* returns NULL without an exception set if type cannot be cached */
+static class_cache_entry *
+__class_cache_lookup(module_state *state, PyTypeObject *type)
+{
+    class_cache_entry *entry = &state->class_cache[__class_cache_index(type)];
+    PyObject *data = NULL;
+    Py_ssize_t len = 0;
+    char *bytes = NULL;
+
+    if (
+        (entry->type == type) &&
+        PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG) &&
+        (entry->version == type->tp_version_tag)
+    ) {
+        return entry;
+    }
+    if (__class_cache_version(state, type) <= 0) {
+        return NULL;
+    }
+    if (!(data = __pack_class(_PyObject_CAST(type)))) {
+        return NULL;
+    }
+    len = PyByteArray_GET_SIZE(data);
+    if (!(bytes = PyMem_Realloc(entry->data, Py_MAX(len, 1)))) {
+        Py_DECREF(data);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memcpy(bytes, PyByteArray_AS_STRING(data), len);
+    Py_DECREF(data);
+    entry->type = NULL; // until complete
+    entry->data = bytes;
+    entry->len = len;
+    if (
+        ((entry->plain = __class_is_plain(state, type)) < 0) ||
+        ((entry->id = __class_id(state, type)) < -1)
+    ) {
+        return NULL;
+    }
+    entry->type = type;
+    entry->version = type->tp_version_tag;
+    return entry;
+}
+
+
+/* classes in the dictionary are packed as a reference to it, classes
+   registered with an id as that id */
+static int
+__pack_class_entry(
+    pack_context *context, PyObject *msg, class_cache_entry *entry
+)
+{
+    int res = -1;
+
+    if (
+        (
+            res = __pack_dictionary_ref(
+                context, msg, _PyObject_CAST(entry->type)
+            )
+        ) <= 0
+    ) {
+        return res;
+    }
+    if (entry->id >= 0) {
+        return __pack_ref(msg, entry->id, MSGPACK_EXT_PYCLASSID, "class");
+    }
+    if (__pack_ext(msg, entry->len, "class")) {
+        return -1;
+    }
+    return __msgpack_buffer(msg, MSGPACK_EXT_PYCLASS, entry->data, entry->len);
+}
+
+
+static int
+_PyClass_Pack(pack_context *context, PyObject *msg, PyObject *obj)
+{
+    class_cache_entry *entry = NULL;
+    Py_ssize_t pos = 0;
+    int res = -1;
+
+    if ((entry = __class_cache_lookup(context->state, (PyTypeObject *)obj))) {
+        return __pack_class_entry(context, msg, entry);
+    }
+    if (
+        PyErr_Occurred() ||
+        ((res = __pack_dictionary_ref(context, msg, obj)) <= 0)
+    ) {
+        return res;
+    }
+    if (
+        __pack_ext_reserve(msg, &pos) ||
+        __pack_class__(msg, obj)
+    ) {
+        return -1;
+    }
+    return __pack_ext_backpatch(msg, pos, MSGPACK_EXT_PYCLASS, "class");
+}
+
+
+/* PyComplex ---------------------------------------------------------------- */
+
+static int
+_PyComplex_Pack(PyObject *msg, PyObject *obj)
+{
+    if (
+        __pack_ext(msg, 16, "complex") ||
+        __msgpack_type(msg, MSGPACK_EXT_PYCOMPLEX)
+    ) {
+        return -1;
+    }
+    return __pack_complex(msg, obj);
+}
+
+
+/* mood.msgpack.Timestamp --------------------------------------------------- */
+
+static int
+_Timestamp_Pack(PyObject *msg, PyObject *obj)
+{
+    return __pack_timestamp(msg, obj, "mood.msgpack.Timestamp");
+}
+
+
+/* PyInstance --------------------------------------------------------------- */
+
+/* the instances of registered plain classes (see __class_is_plain()) are
+   packed as their class, their __dict__ and a map of their set slots,
+   bypassing __reduce__() (and copyreg) altogether */
+
+typedef int (*slotvisitproc)(PyMemberDef *, PyObject *, void *);
+
+/* calls visit for each set slot of obj */
+static int
+__instance_slots(PyObject *obj, slotvisitproc visit, void *arg)
+{
+    PyObject *mro = Py_TYPE(obj)->tp_mro, *value = NULL;
+    PyTypeObject *base = NULL;
+    PyMemberDef *member = NULL;
+    Py_ssize_t len = PyTuple_GET_SIZE(mro), i;
+    int res = 0;
+
+    Py_INCREF(mro);
+    for (i = 0; !res && (i < len); ++i) {
+        base = (PyTypeObject *)PyTuple_GET_ITEM(mro, i);
+        if (
+            !PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE) ||
+            !(member = base->tp_members)
+        ) {
+            continue;
+        }
+        for (; !res && member->name; ++member) {
+            if (
+                (member->type == T_OBJECT_EX) &&
+                !(member->flags & READONLY) &&
+                (value = *(PyObject **)((char *)obj + member->offset))
+            ) {
+                res = visit(member, value, arg);
+            }
+        }
+    }
+    Py_DECREF(mro);
+    return res;
+}
+
+
+static int
+__instance_count_slot(PyMemberDef *member, PyObject *value, void *arg)
+{
+    (*(Py_ssize_t *)arg)++;
+    return 0;
+}
+
+
+typedef struct {
+    pack_context *context;
+    PyObject *msg;
+} instance_pack_arg;
+
+static int
+__instance_pack_slot(PyMemberDef *member, PyObject *value, void *arg)
+{
+    instance_pack_arg *_arg_ = (instance_pack_arg *)arg;
+    PyObject *name = NULL;
+    int res = -1;
+
+    // slot names are unpacked as any other str
+    if (_arg_->context->strings || _arg_->context->dictionary) {
+        if ((name = PyUnicode_InternFromString(member->name))) {
+            res = __pack_string(_arg_->context, _arg_->msg, name);
+            Py_DECREF(name);
+        }
+    }
+    else {
+        res = __pack_unicode(_arg_->msg, member->name, strlen(member->name));
+    }
+    if (res || PackObject(_arg_->context, _arg_->msg, value)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/* returns NULL without an exception set if the instances of type are not
+   packed natively */
+static class_cache_entry *
+__instance_lookup(module_state *state, PyTypeObject *type)
+{
+    class_cache_entry *entry = NULL;
+
+    if (
+        (entry = __class_cache_lookup(state, type)) &&
+        entry->plain &&
+        (
+            RegistryGet(&state->registry, entry->data, entry->len) ==
+            _PyObject_CAST(type)
+        )
+    ) {
+        return entry;
+    }
+    return NULL;
+}
+
+
+static int
+_PyInstance_Pack(
+    pack_context *context,
+    PyObject *msg,
+    PyObject *obj,
+    class_cache_entry *entry
+)
+{
+    instance_pack_arg arg = { .context = context, .msg = msg };
+    PyObject **dictptr = _PyObject_GetDictPtr(obj);
+    Py_ssize_t pos = 0, len = 0;
+    int res = -1;
+
+    // the entry is not used past this point (packing may reuse it)
+    if (
+        __memo_put(context, obj) ||
+        __pack_ext_reserve(msg, &pos) ||
+        __pack_class_entry(context, msg, entry) ||
+        (
+            (dictptr && *dictptr) ?
+            __pack_dict(context, msg, *dictptr) : __pack_map(msg, 0)
+        ) ||
+        __instance_slots(obj, __instance_count_slot, &len) ||
+        __pack_map(msg, len)
+    ) {
+        return -1;
+    }
+    if (!Py_EnterRecursiveCall(_Packing_("instance"))) {
+        res = __instance_slots(obj, __instance_pack_slot, &arg);
+        Py_LeaveRecursiveCall();
+    }
+    if (res) {
+        return -1;
+    }
+    return __pack_ext_backpatch(
+        msg, pos, MSGPACK_EXT_PYINSTANCE, Py_TYPE(obj)->tp_name
+    );
+}
+
+
+/* PyObject ----------------------------------------------------------------- */
+
+/* shared by packing and sizing, returns a str or a tuple */
 static PyObject *
-__pack_complex(PyObject *obj)
+__object_reduce(module_state *state, PyObject *obj, const char *name)
+{
+    PyObject *reduce = NULL;
+
+    if ((reduce = PyObject_CallMethodNoArgs(obj, state->str_reduce))) {
+        if (!PyUnicode_CheckExact(reduce) && !PyTuple_CheckExact(reduce)) {
+            PyErr_SetString(
+                PyExc_TypeError, "__reduce__() must return a str or a tuple"
+            );
+            Py_CLEAR(reduce);
+        }
+    }
+    else if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        PyErr_Clear();
+        PyErr_Format(PyExc_TypeError, "cannot pack '%.200s' objects", name);
+    }
+    return reduce;
+}
+
+
+static int
+_PyObject_Pack(
+    pack_context *context, PyObject *msg, PyObject *obj, const char *name
+)
+{
+    PyObject *reduce = NULL;
+    uint8_t type = MSGPACK_EXT_INVALID; // 0
+    Py_ssize_t pos = 0;
+    int res = -1;
+
+    if (!(reduce = __object_reduce(context->state, obj, name))) {
+        return -1;
+    }
+    if (!__pack_ext_reserve(msg, &pos)) {
+        if (PyUnicode_CheckExact(reduce)) {
+            if (!_PyUnicode_Pack(msg, reduce)) {
+                type = MSGPACK_EXT_PYSINGLETON;
+            }
+        }
+        else if (
+            !__memo_put(context, obj) &&
+            !__pack_tuple(
+                context,
+                msg,
+                _PyTuple_ITEMS(reduce),
+                PyTuple_GET_SIZE(reduce)
+            )
+        ) {
+            type = MSGPACK_EXT_PYOBJECT;
+        }
+        if (type) {
+            res = __pack_ext_backpatch(msg, pos, type, name);
+        }
+    }
+    Py_DECREF(reduce);
+    return res;
+}
+
+
+/* Record ------------------------------------------------------------------- */
+
+static int
+_Record_Pack(
+    pack_context *context, PyObject *msg, PyObject *obj, PyObject *record
+)
+{
+    Record *self = (Record *)record;
+    Py_ssize_t len = PyTuple_GET_SIZE(self->fields), pos = 0, i;
+    PyObject *item = NULL;
+    int res = -1;
+
+    if (
+        !__memo_put(context, obj) &&
+        !__pack_ext_reserve(msg, &pos) &&
+        !__pack_value4(msg, self->tag) &&
+        !__pack_array(msg, len, "record") &&
+        !Py_EnterRecursiveCall(_Packing_("record"))
+    ) {
+        res = 0;
+        for (i = 0; i < len; ++i) {
+            if (
+                (
+                    res = (
+                        (
+                            item = RecordGetField(self, obj, i)
+                        ) ? PackObject(context, msg, item) : -1
+                    )
+                )
+            ) {
+                Py_XDECREF(item);
+                break;
+            }
+            Py_DECREF(item);
+        }
+        Py_LeaveRecursiveCall();
+        if (!res) {
+            res = __pack_ext_backpatch(
+                msg, pos, MSGPACK_EXT_PYRECORD, Py_TYPE(obj)->tp_name
+            );
+        }
+    }
+    return res;
+}
+
+
+/* compiled classes are looked up only if some were compiled, NULL without an
+   exception set if type is not compiled */
+static inline PyObject *
+__record_lookup(module_state *state, PyTypeObject *type)
+{
+    if (!PyDict_GET_SIZE(state->records)) {
+        return NULL;
+    }
+    // borrowed
+    return PyDict_GetItemWithError(state->records, _PyObject_CAST(type));
+}
+
+
+/* Extension ---------------------------------------------------------------- */
+
+/* the objects packed as extensions, looked up once for both packing and
+   sizing (see _Extension_Pack() and _Extension_Size()) */
+enum {
+    EXTENSION_ERROR = -1,
+    EXTENSION_LIST,
+    EXTENSION_SET,
+    EXTENSION_FROZENSET,
+    EXTENSION_BYTEARRAY,
+    EXTENSION_COMPLEX,
+    EXTENSION_MEMORYVIEW,
+    EXTENSION_CLASS,
+    EXTENSION_ARRAY,
+    EXTENSION_TIMESTAMP,
+    EXTENSION_RECORD,       // see extension_lookup.record
+    EXTENSION_INSTANCE,     // see extension_lookup.entry
+    EXTENSION_OBJECT        // __reduce__()
+};
+
+typedef struct {
+    PyObject *record;           // borrowed
+    class_cache_entry *entry;
+} extension_lookup;
+
+static int
+__extension_kind(
+    module_state *state, PyTypeObject *type, extension_lookup *lookup
+)
+{
+    if (type == &PyList_Type) {
+        return EXTENSION_LIST;
+    }
+    if (type == &PySet_Type) {
+        return EXTENSION_SET;
+    }
+    if (type == &PyFrozenSet_Type) {
+        return EXTENSION_FROZENSET;
+    }
+    if (type == &PyByteArray_Type) {
+        return EXTENSION_BYTEARRAY;
+    }
+    if (type == &PyComplex_Type) {
+        return EXTENSION_COMPLEX;
+    }
+    if (type == &PyMemoryView_Type) {
+        return EXTENSION_MEMORYVIEW;
+    }
+    if (type == &PyType_Type) {
+        return EXTENSION_CLASS;
+    }
+    if (type == (PyTypeObject *)state->array_type) {
+        return EXTENSION_ARRAY;
+    }
+    if (type == (PyTypeObject *)state->timestamp_type) {
+        return EXTENSION_TIMESTAMP;
+    }
+    if ((lookup->record = __record_lookup(state, type))) {
+        return EXTENSION_RECORD;
+    }
+    if (
+        !PyErr_Occurred() &&
+        (lookup->entry = __instance_lookup(state, type))
+    ) {
+        return EXTENSION_INSTANCE;
+    }
+    return PyErr_Occurred() ? EXTENSION_ERROR : EXTENSION_OBJECT;
+}
+
+
+static int
+_Extension_Pack(
+    pack_context *context, PyTypeObject *type, PyObject *msg, PyObject *obj
+)
+{
+    extension_lookup lookup = { .record = NULL, .entry = NULL };
+    int res = -1;
+
+    switch (__extension_kind(context->state, type, &lookup)) {
+        case EXTENSION_ERROR:
+            break;
+        case EXTENSION_LIST:
+            res = _PyList_Pack(context, msg, obj);
+            break;
+        case EXTENSION_SET:
+            res = _PySet_Pack(context, msg, obj);
+            break;
+        case EXTENSION_FROZENSET:
+            res = _PyFrozenSet_Pack(context, msg, obj);
+            break;
+        case EXTENSION_BYTEARRAY:
+            res = _PyByteArray_Pack(msg, obj);
+            break;
+        case EXTENSION_COMPLEX:
+            res = _PyComplex_Pack(msg, obj);
+            break;
+        case EXTENSION_MEMORYVIEW:
+            res = _PyMemoryView_Pack(msg, obj);
+            break;
+        case EXTENSION_CLASS:
+            res = _PyClass_Pack(context, msg, obj);
+            break;
+        case EXTENSION_ARRAY:
+            res = _PyArray_Pack(msg, obj);
+            break;
+        case EXTENSION_TIMESTAMP:
+            res = _Timestamp_Pack(msg, obj);
+            break;
+        case EXTENSION_RECORD:
+            res = _Record_Pack(context, msg, obj, lookup.record);
+            break;
+        case EXTENSION_INSTANCE:
+            res = _PyInstance_Pack(context, msg, obj, lookup.entry);
+            break;
+        case EXTENSION_OBJECT:
+            res = _PyObject_Pack(context, msg, obj, type->tp_name);
+            break;
+    }
+    return res;
+}
+
+
+/* --------------------------------------------------------------------------
+   size
+   -------------------------------------------------------------------------- */
+
+#define _Sizing_(n) _While_(sizing, n)
+
+
+/* When presizing a message, sizing gives up (returning -1 without an exception
+   set) on the first object whose size requires calling back into Python, the
+   message is then grown as it is packed instead. */
+typedef struct {
+    module_state *state;
+    int presize;
+} size_context;
+
+
+static Py_ssize_t __size_object(size_context *context, PyObject *obj);
+
+
+/* -------------------------------------------------------------------------- */
+
+static inline Py_ssize_t
+__size_long(int64_t value)
+{
+    if ((MSGPACK_FIXINT_MIN <= value) && (value < MSGPACK_FIXUINT_MAX)) {
+        return 1;
+    }
+    return 1 + (1 << __long_width(value));
+}
+
+
+static inline Py_ssize_t
+__size_bytes(Py_ssize_t len, const char *name)
+{
+    if (len < MSGPACK_UINT1_MAX) {
+        return 2 + len;
+    }
+    else if (len < MSGPACK_UINT2_MAX) {
+        return 3 + len;
+    }
+    else if (len < MSGPACK_UINT4_MAX) {
+        return 5 + len;
+    }
+    _PyErr_ObjTooBig_(name, 0);
+    return -1;
+}
+
+
+static inline Py_ssize_t
+__size_unicode(Py_ssize_t len)
+{
+    if (len < MSGPACK_FIXSTR_MAX) { // fixstr
+        return 1 + len;
+    }
+    return __size_bytes(len, "str");
+}
+
+
+static inline Py_ssize_t
+__size_array(Py_ssize_t len, const char *name)
+{
+    if (len < MSGPACK_FIXOBJ_MAX) { // fixarray, fixmap
+        return 1;
+    }
+    else if (len < MSGPACK_UINT2_MAX) {
+        return 3;
+    }
+    else if (len < MSGPACK_UINT4_MAX) {
+        return 5;
+    }
+    _PyErr_ObjTooBig_(name, 0);
+    return -1;
+}
+
+
+static inline Py_ssize_t
+__size_ext(Py_ssize_t len, const char *name)
+{
+    if (len < MSGPACK_UINT1_MAX) {
+        switch (len) {
+            case 1:
+            case 2:
+            case 4:
+            case 8:
+            case 16:
+                return 2 + len;
+            default:
+                return 3 + len;
+        }
+    }
+    else if (len < MSGPACK_UINT2_MAX) {
+        return 4 + len;
+    }
+    else if (len < MSGPACK_UINT4_MAX) {
+        return 6 + len;
+    }
+    _PyErr_ObjTooBig_(name, 1);
+    return -1;
+}
+
+
+/* see __pack_class_entry() */
+static inline Py_ssize_t
+__size_class_entry(class_cache_entry *entry)
+{
+    if (entry->id >= 0) {
+        return __ref_size(entry->id);
+    }
+    return __size_ext(entry->len, "class");
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+static inline Py_ssize_t
+__size_sequence__(
+    size_context *context,
+    PyObject **items,
+    Py_ssize_t len,
+    const char *name,
+    const char *where
+)
+{
+    Py_ssize_t size = -1, isize = 0, i;
+
+    if (!Py_EnterRecursiveCall(where)) {
+        if ((size = __size_array(len, name)) > 0) {
+            for (i = 0; i < len; ++i) {
+                if ((isize = __size_object(context, items[i])) < 0) {
+                    size = -1;
+                    break;
+                }
+                size += isize;
+            }
+        }
+        Py_LeaveRecursiveCall();
+    }
+    return size;
+}
+
+#define __size_sequence(_ctx_, i, l, n) \
+    __size_sequence__(_ctx_, i, l, n, _Sizing_(n))
+
+
+static inline Py_ssize_t
+__size_dict(size_context *context, PyObject *obj)
+{
+    Py_ssize_t size = -1, ksize = 0, vsize = 0, pos = 0;
+    PyObject *key = NULL, *val = NULL;
+
+    if (!Py_EnterRecursiveCall(_Sizing_("dict"))) {
+        if ((size = __size_array(PyDict_GET_SIZE(obj), "dict")) > 0) {
+            while (PyDict_Next(obj, &pos, &key, &val)) {
+                if (
+                    ((ksize = __size_object(context, key)) < 0) ||
+                    ((vsize = __size_object(context, val)) < 0)
+                ) {
+                    size = -1;
+                    break;
+                }
+                size += ksize + vsize;
+            }
+        }
+        Py_LeaveRecursiveCall();
+    }
+    return size;
+}
+
+
+static inline Py_ssize_t
+__size_anyset__(
+    size_context *context, PyObject *obj, const char *name, const char *where
+)
+{
+    Py_ssize_t size = -1, isize = 0, pos = 0;
+    PyObject *item = NULL;
+    Py_hash_t hash;
+
+    if (!Py_EnterRecursiveCall(where)) {
+        if ((size = __size_array(PySet_GET_SIZE(obj), name)) > 0) {
+            while (_PySet_NextEntry(obj, &pos, &item, &hash)) {
+                if ((isize = __size_object(context, item)) < 0) {
+                    size = -1;
+                    break;
+                }
+                size += isize;
+            }
+        }
+        Py_LeaveRecursiveCall();
+    }
+    return size;
+}
+
+#define __size_anyset(_ctx_, o, n) \
+    __size_anyset__(_ctx_, o, n, _Sizing_(n))
+
+
+static inline Py_ssize_t
+__size_extension(Py_ssize_t size, const char *name)
+{
+    if (size < 0) {
+        return -1;
+    }
+    return __size_ext(size, name);
+}
+
+
+/* PyLong ------------------------------------------------------------------- */
+
+static Py_ssize_t
+_PyLong_Size(PyObject *obj)
+{
+    int overflow = 0;
+    int64_t value = 0;
+
+    if (__long_compact(obj, &value)) {
+        return __size_long(value);
+    }
+    value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    if (overflow) {
+        if (overflow < 0) {
+            _PyErr_ObjTooBig_("int", 0);
+            return -1;
+        }
+        if (
+            (PyLong_AsUnsignedLongLong(obj) == (uint64_t)-1) &&
+            PyErr_Occurred()
+        ) {
+            return -1;
+        }
+        return 9;
+    }
+    if ((value == -1) && PyErr_Occurred()) {
+        return -1;
+    }
+    return __size_long(value);
+}
+
+
+/* PyUnicode ---------------------------------------------------------------- */
+
+static Py_ssize_t
+_PyUnicode_Size(PyObject *obj)
+{
+    Py_ssize_t len;
+
+    if (PyUnicode_READY(obj)) {
+        return -1;
+    }
+    if (
+        !__utf8_cached(obj, &len) &&
+        (!PyUnicode_IS_COMPACT(obj) || ((len = __utf8_length(obj)) < 0)) &&
+        !PyUnicode_AsUTF8AndSize(obj, &len)
+    ) {
+        return -1;
+    }
+    return __size_unicode(len);
+}
+
+
+/* PyArray, PyMemoryView ---------------------------------------------------- */
+
+static Py_ssize_t
+__size_typed(PyObject *obj, const char *name)
+{
+    Py_buffer view;
+    Py_ssize_t len = 0;
+
+    if (__typed_view(obj, &view, name) < 0) {
+        return -1;
+    }
+    len = view.len;
+    PyBuffer_Release(&view);
+    return __size_ext((MSGPACK_TYPED_HEADER + len), name);
+}
+
+
+/* PyClass ------------------------------------------------------------------ */
+
+static Py_ssize_t
+__size_class(module_state *state, PyObject *obj)
 {
-    Py_complex complex = ((PyComplexObject *)obj)->cval;
-    PyObject *data = NULL;
+    PyObject *_modname_ = NULL, *_qualname_ = NULL;
+    Py_ssize_t size = -1, msize = 0, qsize = 0;
 
     if (
-        (data = NewMessage()) &&
-        (__pack_float8(data, complex.real) || __pack_float8(data, complex.imag))
+        (_modname_ = PyObject_GetAttr(obj, state->str_module)) &&
+        (_qualname_ = PyObject_GetAttr(obj, state->str_qualname))
     ) {
-        Py_CLEAR(data);
+        if (
+            !PyUnicode_CheckExact(_modname_) ||
+            !PyUnicode_CheckExact(_qualname_)
+        ) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "expected strings, got: __module__: %.200s, __qualname__: %.200s",
+                Py_TYPE(_modname_)->tp_name,
+                Py_TYPE(_qualname_)->tp_name
+            );
+        }
+        else if (
+            ((msize = _PyUnicode_Size(_modname_)) > 0) &&
+            ((qsize = _PyUnicode_Size(_qualname_)) > 0)
+        ) {
+            size = msize + qsize;
+        }
     }
-    return data;
+    Py_XDECREF(_qualname_);
+    Py_XDECREF(_modname_);
+    return size;
 }
 
 
-/* timestamp ---------------------------------------------------------------- */
+/* PyInstance --------------------------------------------------------------- */
 
-static inline int
-__pack_timestamp__(PyObject *msg, uint64_t seconds, uint32_t nanoseconds)
+typedef struct {
+    size_context *context;
+    Py_ssize_t size;
+} instance_size_arg;
+
+static int
+__instance_size_slot(PyMemberDef *member, PyObject *value, void *arg)
 {
-    uint64_t value = 0;
+    instance_size_arg *_arg_ = (instance_size_arg *)arg;
+    Py_ssize_t size = 0;
 
-    if ((seconds >> 34) == 0) {
-        value = (((uint64_t)nanoseconds << 34) | seconds);
-        if ((value & 0xffffffff00000000L) == 0) {
-            return __pack_value4(msg, (uint32_t)value);
-        }
-        return __pack_value8(msg, value);
+    if ((size = __size_object(_arg_->context, value)) < 0) {
+        return -1;
     }
-    return (__pack_value4(msg, nanoseconds)) ? -1 : __pack_value8(msg, seconds);
+    _arg_->size += __size_unicode(strlen(member->name)) + size;
+    return 0;
 }
 
-static PyObject *
-__pack_timestamp(PyObject *obj)
+
+static Py_ssize_t
+_PyInstance_Size(size_context *context, PyObject *obj, class_cache_entry *entry)
 {
-    Timestamp *timestamp = (Timestamp *)obj;
-    PyObject *data = NULL;
+    instance_size_arg arg = { .context = context, .size = 0 };
+    PyObject **dictptr = _PyObject_GetDictPtr(obj);
+    Py_ssize_t size = -1, dsize = 1, len = 0, msize = 0;
+    int res = -1;
 
+    // the entry is not used past this point (sizing may reuse it)
     if (
-        (data = NewMessage()) &&
-        __pack_timestamp__(data, timestamp->seconds, timestamp->nanoseconds)
+        ((size = __size_class_entry(entry)) < 0) ||
+        (
+            dictptr && *dictptr &&
+            ((dsize = __size_dict(context, *dictptr)) < 0)
+        ) ||
+        __instance_slots(obj, __instance_count_slot, &len) ||
+        ((msize = __size_array(len, "dict")) < 0)
     ) {
-        Py_CLEAR(data);
+        return -1;
     }
-    return data;
+    if (!Py_EnterRecursiveCall(_Sizing_("instance"))) {
+        res = __instance_slots(obj, __instance_size_slot, &arg);
+        Py_LeaveRecursiveCall();
+    }
+    if (res) {
+        return -1;
+    }
+    return __size_ext(
+        (size + dsize + msize + arg.size), Py_TYPE(obj)->tp_name
+    );
 }
 
 
-/* -------------------------------------------------------------------------- */
-
-#define __pack_ext_sequence(_mod_, m, d, i, l, t, n) \
-    ((__pack_sequence(_mod_, d, i, l, n)) ? -1 : __pack_extension(m, d, t, n))
-
+/* PyObject ----------------------------------------------------------------- */
 
-#define __pack_ext_anyset(_mod_, m, d, o, t, n) \
-    ((__pack_anyset(_mod_, d, o, n)) ? -1 : __pack_extension(m, d, t, n))
+static Py_ssize_t
+_PyObject_Size(size_context *context, PyObject *obj, const char *name)
+{
+    PyObject *reduce = NULL;
+    Py_ssize_t size = -1;
 
+    if (context->presize) {
+        return -1;
+    }
+    if ((reduce = __object_reduce(context->state, obj, name))) {
+        size = __size_extension(
+            (
+                PyUnicode_CheckExact(reduce) ?
+                _PyUnicode_Size(reduce) : __size_object(context, reduce)
+            ),
+            name
+        );
+        Py_DECREF(reduce);
+    }
+    return size;
+}
 
-/* PyList ------------------------------------------------------------------- */
 
-#define __pack_ext_list(_mod_, m, d, i, l) \
-    __pack_ext_sequence(_mod_, m, d, i, l, MSGPACK_EXT_PYLIST, "list")
+/* Record ------------------------------------------------------------------- */
 
-static int
-_PyList_Pack(PyObject *module, PyObject *msg, PyObject *obj)
+static Py_ssize_t
+_Record_Size(size_context *context, PyObject *obj, PyObject *record)
 {
-    PyObject **items = _PyList_ITEMS(obj);
-    Py_ssize_t len = PyList_GET_SIZE(obj);
-    PyObject *data = NULL;
-    int res = -1;
+    Record *self = (Record *)record;
+    Py_ssize_t len = PyTuple_GET_SIZE(self->fields), size = -1, isize = 0, i;
+    PyObject *item = NULL;
 
-    if ((data = NewMessage())) {
-        res = __pack_ext_list(module, msg, data, items, len);
-        Py_DECREF(data);
+    if (!Py_EnterRecursiveCall(_Sizing_("record"))) {
+        if ((size = __size_array(len, "record")) > 0) {
+            size += MSGPACK_RECORD_TAG;
+            for (i = 0; i < len; ++i) {
+                if (
+                    !(item = RecordGetField(self, obj, i)) ||
+                    ((isize = __size_object(context, item)) < 0)
+                ) {
+                    Py_XDECREF(item);
+                    size = -1;
+                    break;
+                }
+                Py_DECREF(item);
+                size += isize;
+            }
+        }
+        Py_LeaveRecursiveCall();
     }
-    return res;
+    return __size_extension(size, Py_TYPE(obj)->tp_name);
 }
 
 
-/* PySet -------------------------------------------------------------------- */
-
-#define __pack_ext_set(_mod_, m, d, o) \
-    __pack_ext_anyset(_mod_, m, d, o, MSGPACK_EXT_PYSET, "set")
+/* Extension ---------------------------------------------------------------- */
 
-static int
-_PySet_Pack(PyObject *module, PyObject *msg, PyObject *obj)
+static Py_ssize_t
+_Extension_Size(size_context *context, PyTypeObject *type, PyObject *obj)
 {
-    PyObject *data = NULL;
-    int res = -1;
-
-    if ((data = NewMessage())) {
-        res = __pack_ext_set(module, msg, data, obj);
-        Py_DECREF(data);
-    }
-    return res;
+    extension_lookup lookup = { .record = NULL, .entry = NULL };
+    class_cache_entry *entry = NULL;
+    Timestamp *timestamp = NULL;
+    Py_ssize_t size = -1;
+
+    switch (__extension_kind(context->state, type, &lookup)) {
+        case EXTENSION_ERROR:
+            break;
+        case EXTENSION_LIST:
+            size = __size_extension(
+                __size_sequence(
+                    context, _PyList_ITEMS(obj), PyList_GET_SIZE(obj), "list"
+                ),
+                "list"
+            );
+            break;
+        case EXTENSION_SET:
+            size = __size_extension(__size_anyset(context, obj, "set"), "set");
+            break;
+        case EXTENSION_FROZENSET:
+            size = __size_extension(
+                __size_anyset(context, obj, "frozenset"), "frozenset"
+            );
+            break;
+        case EXTENSION_BYTEARRAY:
+            size = __size_ext(PyByteArray_GET_SIZE(obj), "bytearray");
+            break;
+        case EXTENSION_COMPLEX:
+            size = __size_ext(16, "complex");
+            break;
+        case EXTENSION_MEMORYVIEW:
+            size = __size_typed(obj, "memoryview");
+            break;
+        case EXTENSION_CLASS:
+            if (
+                (
+                    entry = __class_cache_lookup(
+                        context->state, (PyTypeObject *)obj
+                    )
+                )
+            ) {
+                size = __size_class_entry(entry);
+            }
+            else if (!PyErr_Occurred()) {
+                size = __size_extension(
+                    __size_class(context->state, obj), "class"
+                );
+            }
+            break;
+        case EXTENSION_ARRAY:
+            size = __size_typed(obj, "array.array");
+            break;
+        case EXTENSION_TIMESTAMP:
+            timestamp = (Timestamp *)obj;
+            size = __size_ext(
+                __timestamp_size(timestamp->seconds, timestamp->nanoseconds),
+                "mood.msgpack.Timestamp"
+            );
+            break;
+        case EXTENSION_RECORD:
+            size = _Record_Size(context, obj, lookup.record);
+            break;
+        case EXTENSION_INSTANCE:
+            size = _PyInstance_Size(context, obj, lookup.entry);
+            break;
+        case EXTENSION_OBJECT:
+            size = _PyObject_Size(context, obj, type->tp_name);
+            break;
+    }
+    return size;
 }
 
 
-/* PyFrozenSet -------------------------------------------------------------- */
-
-#define __pack_ext_frozenset(_mod_, m, d, o) \
-    __pack_ext_anyset(_mod_, m, d, o, MSGPACK_EXT_PYFROZENSET, "frozenset")
+/* -------------------------------------------------------------------------- */
 
-static int
-_PyFrozenSet_Pack(PyObject *module, PyObject *msg, PyObject *obj)
+static Py_ssize_t
+__size_object(size_context *context, PyObject *obj)
 {
-    PyObject *data = NULL;
-    int res = -1;
+    PyTypeObject *type = Py_TYPE(obj);
+    Py_ssize_t size = -1;
 
-    if ((data = NewMessage())) {
-        res = __pack_ext_frozenset(module, msg, data, obj);
-        Py_DECREF(data);
+    if ((obj == Py_None) || (obj == Py_False) || (obj == Py_True)) {
+        size = 1;
     }
-    return res;
+    else if (type == &PyLong_Type) {
+        size = _PyLong_Size(obj);
+    }
+    else if (type == &PyFloat_Type) {
+        size = 9;
+    }
+    else if (type == &PyBytes_Type) {
+        size = __size_bytes(PyBytes_GET_SIZE(obj), "bytes");
+    }
+    else if (type == &PyUnicode_Type) {
+        size = _PyUnicode_Size(obj);
+    }
+    else if (type == &PyTuple_Type) {
+        size = __size_sequence(
+            context, _PyTuple_ITEMS(obj), PyTuple_GET_SIZE(obj), "tuple"
+        );
+    }
+    else if (type == &PyDict_Type) {
+        size = __size_dict(context, obj);
+    }
+    else {
+        size = _Extension_Size(context, type, obj);
+    }
+    return size;
 }
 
 
-/* PyByteArray -------------------------------------------------------------- */
+/* --------------------------------------------------------------------------
+   interface
+   -------------------------------------------------------------------------- */
 
-#define __pack_ext_bytearray(m, d) \
-    __pack_extension(m, d, MSGPACK_EXT_PYBYTEARRAY, "bytearray")
+PyObject *
+NewMessage(void)
+{
+    return _PyObject_CAST(__msg_new__(32));
+}
 
 
-static int
-_PyByteArray_Pack(PyObject *msg, PyObject *obj)
+PyObject *
+NewMessageOfSize(Py_ssize_t size)
 {
-    return __pack_ext_bytearray(msg, obj);
+    return _PyObject_CAST(__msg_new__(size + 1));
 }
 
 
-/* PyClass ------------------------------------------------------------------ */
+void
+ResetMessage(PyObject *msg)
+{
+    __msg_setsize__((PyByteArrayObject *)msg, 0);
+}
 
-#define __pack_ext_class(m, d) \
-    __pack_extension(m, d, MSGPACK_EXT_PYCLASS, "class")
 
-static int
-_PyClass_Pack(PyObject *msg, PyObject *obj)
+void
+ClearClassCache(class_cache_entry *cache)
 {
-    PyObject *data = NULL;
-    int res = -1;
+    Py_ssize_t i;
 
-    if ((data = __pack_class(obj))) {
-        res = __pack_ext_class(msg, data);
-        Py_DECREF(data);
+    for (i = 0; i < MSGPACK_CLASS_CACHE_SIZE; ++i) {
+        PyMem_Free(cache[i].data);
+        cache[i].data = NULL;
+        cache[i].type = NULL;
     }
-    return res;
 }
 
 
-/* PyComplex ---------------------------------------------------------------- */
-
-#define __pack_ext_complex(m, d) \
-    __pack_extension(m, d, MSGPACK_EXT_PYCOMPLEX, "complex")
-
-static int
-_PyComplex_Pack(PyObject *msg, PyObject *obj)
+int
+RegisterObject(registry_table *registry, PyObject *obj)
 {
     PyObject *data = NULL;
     int res = -1;
 
-    if ((data = __pack_complex(obj))) {
-        res = __pack_ext_complex(msg, data);
+    if (
+        (data = (PyType_Check(obj) ? __pack_class(obj) : __pack_singleton(obj)))
+    ) {
+        res = RegistrySet(
+            registry,
+            PyByteArray_AS_STRING(data),
+            PyByteArray_GET_SIZE(data),
+            obj
+        );
         Py_DECREF(data);
     }
     return res;
 }
 
 
-/* mood.msgpack.Timestamp --------------------------------------------------- */
-
-#define __pack_ext_timestamp(m, d) \
-    __pack_extension(m, d, MSGPACK_EXT_TIMESTAMP, "mood.msgpack.Timestamp")
-
-static int
-_Timestamp_Pack(PyObject *msg, PyObject *obj)
+int
+RegisterClassId(module_state *state, PyObject *cls, Py_ssize_t id)
 {
-    PyObject *data = NULL;
+    PyObject *other = NULL, *value = NULL, **classes = NULL;
+    Py_ssize_t current = -1, n;
     int res = -1;
 
-    if ((data = __pack_timestamp(obj))) {
-        res = __pack_ext_timestamp(msg, data);
-        Py_DECREF(data);
+    if ((id < 0) || (id >= MSGPACK_CLASS_ID_MAX)) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "class id must be in the range [0, %lld), not %zd",
+            MSGPACK_CLASS_ID_MAX, id
+        );
+        return -1;
+    }
+    if ((current = __class_id(state, (PyTypeObject *)cls)) < -1) {
+        return -1;
+    }
+    if ((current >= 0) && (current != id)) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "'%.200s' is already registered with id %zd",
+            ((PyTypeObject *)cls)->tp_name, current
+        );
+        return -1;
+    }
+    if ((id < state->nclasses) && (other = state->classes[id])) {
+        if (other != cls) {
+            PyErr_Format(
+                PyExc_ValueError,
+                "'%.200s' and '%.200s' have the same id (%zd)",
+                ((PyTypeObject *)cls)->tp_name,
+                ((PyTypeObject *)other)->tp_name,
+                id
+            );
+            return -1;
+        }
+        return 0;
+    }
+    if (id >= state->nclasses) {
+        n = Py_MAX((id + 1), (state->nclasses * 2));
+        if (n > MSGPACK_CLASS_ID_MAX) {
+            n = MSGPACK_CLASS_ID_MAX;
+        }
+        if (!(classes = PyMem_Resize(state->classes, PyObject *, n))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memset(
+            (classes + state->nclasses),
+            0,
+            ((n - state->nclasses) * sizeof(PyObject *))
+        );
+        state->classes = classes;
+        state->nclasses = n;
+    }
+    if ((value = PyLong_FromSsize_t(id))) {
+        if (!(res = PyDict_SetItem(state->class_ids, cls, value))) {
+            state->classes[id] = Py_NewRef(cls);
+            // cached entries do not know about the id yet
+            ClearClassCache(state->class_cache);
+        }
+        Py_DECREF(value);
     }
     return res;
 }
 
 
-/* PyObject ----------------------------------------------------------------- */
+int
+InitPackContext(pack_context *context, PyObject *module, int flags)
+{
+    context->memo.size = context->memo.mask = 0;
+    context->memo.entries = NULL;
+    context->strings = NULL;
+    context->nstrings = 0;
+    context->dictionary = NULL;
+    if (!(context->state = __PyModule_GetState__(module))) {
+        return -1;
+    }
+    if ((flags & MSGPACK_PACK_STRINGS) && !(context->strings = PyDict_New())) {
+        return -1;
+    }
+    context->module = module;
+    context->flags = flags;
+    return 0;
+}
 
-static int
-_PyObject_Pack(PyObject *module, PyObject *msg, PyObject *obj, const char *name)
+
+void
+ClearPackContext(pack_context *context)
 {
-    PyObject *reduce = NULL, *data = NULL;
-    uint8_t type = MSGPACK_EXT_INVALID; // 0
-    int res = -1;
+    memo_table *memo = &context->memo;
+    Py_ssize_t i;
 
-    if ((reduce = _PyObject_CallMethodId(obj, &PyId___reduce__, NULL))) {
-        if ((data = NewMessage())) {
-            if (PyUnicode_CheckExact(reduce)) {
-                if (!_PyUnicode_Pack(data, reduce)) {
-                    type = MSGPACK_EXT_PYSINGLETON;
-                }
-            }
-            else if (PyTuple_CheckExact(reduce)) {
-                if (!_PyTuple_Pack(module, data, reduce)) {
-                    type = MSGPACK_EXT_PYOBJECT;
-                }
-            }
-            else {
-                PyErr_SetString(
-                    PyExc_TypeError, "__reduce__() must return a str or a tuple"
-                );
-            }
-            if (type) {
-                res = __pack_extension(msg, data, type, name);
-            }
-            Py_DECREF(data);
+    if (memo->entries) {
+        for (i = 0; i <= memo->mask; ++i) {
+            Py_XDECREF(memo->entries[i].obj);
         }
-        Py_DECREF(reduce);
-    }
-    else if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
-        PyErr_Clear();
-        PyErr_Format(PyExc_TypeError, "cannot pack '%.200s' objects", name);
+        PyMem_Free(memo->entries);
+        memo->entries = NULL;
     }
-    return res;
+    memo->size = memo->mask = 0;
+    Py_CLEAR(context->strings);
 }
 
 
-/* Extension ---------------------------------------------------------------- */
+Py_ssize_t
+PackedSize(PyObject *module, PyObject *obj)
+{
+    size_context context = { .state = NULL, .presize = 0 };
+
+    if (!(context.state = __PyModule_GetState__(module))) {
+        return -1;
+    }
+    return __size_object(&context, obj);
+}
 
+
+/* memoized (deduplicated) messages are wrapped in a MSGPACK_EXT_PYMEMO
+   (MSGPACK_EXT_PYSTRINGS) extension so that unpacking knows to index objects
+   (strs) as well */
 static int
-_Extension_Pack(
-    PyObject *module, PyTypeObject *type, PyObject *msg, PyObject *obj
-)
+__pack_indexed(pack_context *context, PyObject *msg, PyObject *obj, int flags)
 {
-    module_state *state = NULL;
-    int res = -1;
+    Py_ssize_t pos = 0;
+    uint8_t type = MSGPACK_EXT_INVALID;
+    const char *name = NULL;
 
-    if (type == &PyList_Type) {
-        res = _PyList_Pack(module, msg, obj);
+    if (flags & MSGPACK_PACK_STRINGS) {
+        flags &= ~MSGPACK_PACK_STRINGS;
+        type = MSGPACK_EXT_PYSTRINGS;
+        name = "strings";
     }
-    else if (type == &PySet_Type) {
-        res = _PySet_Pack(module, msg, obj);
+    else if (flags & MSGPACK_PACK_MEMO) {
+        flags &= ~MSGPACK_PACK_MEMO;
+        type = MSGPACK_EXT_PYMEMO;
+        name = "memo";
     }
-    else if (type == &PyFrozenSet_Type) {
-        res = _PyFrozenSet_Pack(module, msg, obj);
-    }
-    else if (type == &PyByteArray_Type) {
-        res = _PyByteArray_Pack(msg, obj);
-    }
-    else if (type == &PyType_Type) {
-        res = _PyClass_Pack(msg, obj);
-    }
-    else if (type == &PyComplex_Type) {
-        res = _PyComplex_Pack(msg, obj);
+    else {
+        return PackObject(context, msg, obj);
     }
-    else if ((state = __PyModule_GetState__(module))) {
-        if (type == (PyTypeObject *)state->timestamp_type) {
-            res = _Timestamp_Pack(msg, obj);
-        }
-        else {
-            res = _PyObject_Pack(module, msg, obj, type->tp_name);
-        }
+    if (
+        __pack_ext_reserve(msg, &pos) ||
+        __pack_indexed(context, msg, obj, flags)
+    ) {
+        return -1;
     }
-    return res;
+    return __pack_ext_backpatch(msg, pos, type, name);
 }
 
 
-/* --------------------------------------------------------------------------
-   interface
-   -------------------------------------------------------------------------- */
-
+/* indexed messages (and messages packed with a dictionary) are not presized
+   as sizing doesn't account for references, neither are messages holding
+   objects whose size requires calling back into Python (see size_context) */
 PyObject *
-NewMessage(void)
+PackMessage(PyObject *module, PyObject *obj, int flags, PyObject *dictionary)
 {
-    return _PyObject_CAST(__msg_new__(32));
+    pack_context context;
+    size_context sizing = { .state = NULL, .presize = 1 };
+    PyObject *msg = NULL;
+    Py_ssize_t size = -1;
+
+    if (!InitPackContext(&context, module, flags)) {
+        context.dictionary = dictionary;
+        if (
+            dictionary || (flags & (MSGPACK_PACK_MEMO | MSGPACK_PACK_STRINGS))
+        ) {
+            if (
+                (msg = NewMessage()) &&
+                __pack_indexed(&context, msg, obj, flags)
+            ) {
+                Py_CLEAR(msg);
+            }
+        }
+        else {
+            sizing.state = context.state;
+            if ((size = __size_object(&sizing, obj)) >= 0) {
+                msg = NewMessageOfSize(size);
+            }
+            else if (!PyErr_Occurred()) {
+                msg = NewMessage();
+            }
+            if (msg && PackObject(&context, msg, obj)) {
+                Py_CLEAR(msg);
+            }
+        }
+    }
+    ClearPackContext(&context);
+    return msg;
 }
 
 
-int
-RegisterObject(PyObject *registry, PyObject *obj)
+Py_ssize_t
+PackMessageInto(
+    PyObject *module, Py_buffer *buffer, Py_ssize_t offset, PyObject *obj
+)
 {
-    PyObject *data = NULL, *key = NULL;
+    pack_context context;
+    PyByteArrayObject msg;
+    Py_ssize_t size = -1, len = buffer->len - offset;
     int res = -1;
 
-    if (
-        (data = (PyType_Check(obj) ? __pack_class(obj) : __pack_singleton(obj)))
-    ) {
-        if ((key = _PyBytes_FromPyByteArray(data))) {
-            res = PyDict_SetItem(registry, key, obj);
-            Py_DECREF(key);
-        }
-        Py_DECREF(data);
+    if ((offset < 0) || (len < 0)) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "offset %zd out of range for %zd-byte buffer", offset, buffer->len
+        );
+        return -1;
     }
-    return res;
+    if ((size = PackedSize(module, obj)) < 0) {
+        return -1;
+    }
+    if (size > len) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "buffer too small: %zd bytes required, %zd available", size, len
+        );
+        return -1;
+    }
+    __msg_wrap__(&msg, ((char *)buffer->buf + offset), len);
+    if (!InitPackContext(&context, module, MSGPACK_PACK_DEFAULT)) {
+        res = PackObject(&context, _PyObject_CAST(&msg), obj);
+    }
+    ClearPackContext(&context);
+    return (res) ? -1 : Py_SIZE(&msg);
 }
 
 
 int
-PackObject(PyObject *module, PyObject *msg, PyObject *obj)
+PackObject(pack_context *context, PyObject *msg, PyObject *obj)
 {
     PyTypeObject *type = Py_TYPE(obj);
+    Py_ssize_t index = -1;
     int res = -1;
 
-    if (obj == Py_None) {
+    if ((index = __memo_get(&context->memo, obj)) >= 0) {
+        res = __pack_ref(msg, index, MSGPACK_EXT_PYREF, "reference");
+    }
+    else if (obj == Py_None) {
         res = _Py_None_Pack(msg);
     }
     else if (obj == Py_False) {
@@ -1087,16 +3077,17 @@ PackObject(PyObject *module, PyObject *msg, PyObject *obj)
         res = _PyBytes_Pack(msg, obj);
     }
     else if (type == &PyUnicode_Type) {
-        res = _PyUnicode_Pack(msg, obj);
+        res = (context->strings || context->dictionary) ?
+            __pack_string(context, msg, obj) : _PyUnicode_Pack(msg, obj);
     }
     else if (type == &PyTuple_Type) {
-        res = _PyTuple_Pack(module, msg, obj);
+        res = _PyTuple_Pack(context, msg, obj);
     }
     else if (type == &PyDict_Type) {
-        res = _PyDict_Pack(module, msg, obj);
+        res = _PyDict_Pack(context, msg, obj);
     }
     else {
-        res = _Extension_Pack(module, type, msg, obj);
+        res = _Extension_Pack(context, type, msg, obj);
     }
     return res;
 }
@@ -0,0 +1,231 @@
+#include "msgpack.h"
+
+
+#define MSGPACK_PACKER_MIN_SIZE 31
+
+
+/* --------------------------------------------------------------------------
+   Packer
+   -------------------------------------------------------------------------- */
+
+static PyObject *
+_Packer_New(PyTypeObject *type, Py_ssize_t size, PyObject *arg)
+{
+    Packer *self = NULL;
+    PyObject *module = NULL, *dictionary = NULL;
+    module_state *state = NULL;
+
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "argument 'size' must be >= 0");
+        return NULL;
+    }
+    if (
+        !(module = PyType_GetModule(type)) ||
+        !(state = __PyModule_GetState__(module)) ||
+        (!(dictionary = DictionaryArg(state, arg)) && PyErr_Occurred())
+    ) {
+        return NULL;
+    }
+    if ((self = PyObject_GC_NEW(Packer, type))) {
+        self->module = Py_NewRef(module);
+        self->msg = NULL;
+        self->high_water = size;
+        self->dictionary = Py_XNewRef(dictionary);
+        PyObject_GC_Track(self);
+    }
+    return _PyObject_CAST(self);
+}
+
+
+/* the retained message is reused unless a previous result still exports it,
+   in which case a new one is allocated (sized after the high-water mark) and
+   the old one is left to the exporter */
+static int
+_Packer_Reset(Packer *self)
+{
+    PyObject *msg = NULL;
+
+    if (self->msg && !((PyByteArrayObject *)self->msg)->ob_exports) {
+        ResetMessage(self->msg);
+        return 0;
+    }
+    if (
+        !(
+            msg = NewMessageOfSize(
+                Py_MAX(self->high_water, MSGPACK_PACKER_MIN_SIZE)
+            )
+        )
+    ) {
+        return -1;
+    }
+    Py_XSETREF(self->msg, msg);
+    return 0;
+}
+
+
+static int
+_Packer_Pack(Packer *self, PyObject *obj)
+{
+    pack_context context;
+    Py_ssize_t size = 0;
+    int res = -1;
+
+    if (!InitPackContext(&context, self->module, MSGPACK_PACK_DEFAULT)) {
+        context.dictionary = self->dictionary;
+        res = (_Packer_Reset(self) || PackObject(&context, self->msg, obj));
+    }
+    ClearPackContext(&context);
+    if (res) {
+        return -1;
+    }
+    if ((size = PyByteArray_GET_SIZE(self->msg)) > self->high_water) {
+        self->high_water = size;
+    }
+    return 0;
+}
+
+
+/* Packer_Type -------------------------------------------------------------- */
+
+/* Packer_Type.tp_new */
+static PyObject *
+Packer_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"size", "dictionary", NULL};
+    PyObject *dictionary = Py_None;
+    Py_ssize_t size = 0;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "|n$O:__new__", kwlist, &size, &dictionary
+        )
+    ) {
+        return NULL;
+    }
+    return _Packer_New(type, size, dictionary);
+}
+
+
+/* Packer_Type.tp_traverse */
+static int
+Packer_tp_traverse(Packer *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self)); // heap type
+    Py_VISIT(self->module);
+    Py_VISIT(self->dictionary);
+    return 0;
+}
+
+
+/* Packer_Type.tp_clear */
+static int
+Packer_tp_clear(Packer *self)
+{
+    Py_CLEAR(self->dictionary);
+    Py_CLEAR(self->msg);
+    Py_CLEAR(self->module);
+    return 0;
+}
+
+
+/* Packer_Type.tp_dealloc */
+static void
+Packer_tp_dealloc(Packer *self)
+{
+    PyObject_GC_UnTrack(self);
+    Packer_tp_clear(self);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
+}
+
+
+/* Packer.pack() */
+PyDoc_STRVAR(Packer_pack_doc,
+"pack(obj) -> memoryview");
+
+static PyObject *
+Packer_pack(Packer *self, PyObject *obj)
+{
+    if (_Packer_Pack(self, obj)) {
+        return NULL;
+    }
+    return PyMemoryView_FromObject(self->msg);
+}
+
+
+/* Packer.pack_bytes() */
+PyDoc_STRVAR(Packer_pack_bytes_doc,
+"pack_bytes(obj) -> bytes");
+
+static PyObject *
+Packer_pack_bytes(Packer *self, PyObject *obj)
+{
+    if (_Packer_Pack(self, obj)) {
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize(
+        PyByteArray_AS_STRING(self->msg), PyByteArray_GET_SIZE(self->msg)
+    );
+}
+
+
+/* Packer.clear() */
+PyDoc_STRVAR(Packer_clear_doc,
+"clear()");
+
+static PyObject *
+Packer_clear(Packer *self)
+{
+    Py_CLEAR(self->msg);
+    self->high_water = 0;
+    Py_RETURN_NONE;
+}
+
+
+/* Packer_Type.tp_methods */
+static PyMethodDef Packer_tp_methods[] = {
+    {
+        "pack", (PyCFunction)Packer_pack,
+        METH_O, Packer_pack_doc
+    },
+    {
+        "pack_bytes", (PyCFunction)Packer_pack_bytes,
+        METH_O, Packer_pack_bytes_doc
+    },
+    {
+        "clear", (PyCFunction)Packer_clear,
+        METH_NOARGS, Packer_clear_doc
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+/* Packer_Type.tp_members */
+static PyMemberDef Packer_tp_members[] = {
+    {
+        "high_water", T_PYSSIZET, offsetof(Packer, high_water),
+        READONLY, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot Packer_Slots[] = {
+    {Py_tp_doc, "Packer([size=0], *, dictionary=None)"},
+    {Py_tp_new, Packer_tp_new},
+    {Py_tp_traverse, Packer_tp_traverse},
+    {Py_tp_clear, Packer_tp_clear},
+    {Py_tp_dealloc, Packer_tp_dealloc},
+    {Py_tp_methods, Packer_tp_methods},
+    {Py_tp_members, Packer_tp_members},
+    {0, NULL}
+};
+
+
+PyType_Spec Packer_Spec = {
+    .name = "mood.msgpack.Packer",
+    .basicsize = sizeof(Packer),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = Packer_Slots
+};
@@ -0,0 +1,471 @@
+#include "msgpack.h"
+
+
+/* --------------------------------------------------------------------------
+   Record
+   -------------------------------------------------------------------------- */
+
+/* A record is the codec of a compiled class: its instances are packed as the
+   tag of the class followed by the array of their fields, in order. Fields
+   stored in slots are read and written directly, others go through the
+   generic attribute protocol (bypassing __setattr__() on unpacking). */
+
+
+/* "module.qualname", hashed with 32-bit FNV-1a (stable across processes) */
+static int
+__record_tag(module_state *state, PyTypeObject *cls, uint32_t *tag)
+{
+    PyObject *obj = _PyObject_CAST(cls), *name = NULL;
+    PyObject *_modname_ = NULL, *_qualname_ = NULL;
+    const char *bytes = NULL;
+    Py_ssize_t len = 0, i;
+    uint32_t hash = 2166136261U;
+
+    if (
+        (_modname_ = PyObject_GetAttr(obj, state->str_module)) &&
+        (_qualname_ = PyObject_GetAttr(obj, state->str_qualname)) &&
+        (name = PyUnicode_FromFormat("%S.%S", _modname_, _qualname_)) &&
+        (bytes = PyUnicode_AsUTF8AndSize(name, &len))
+    ) {
+        for (i = 0; i < len; ++i) {
+            hash = (hash ^ (uint8_t)bytes[i]) * 16777619U;
+        }
+        *tag = hash;
+    }
+    Py_XDECREF(name);
+    Py_XDECREF(_qualname_);
+    Py_XDECREF(_modname_);
+    return (bytes) ? 0 : -1;
+}
+
+
+/* private names in __slots__ are mangled */
+static PyObject *
+__record_mangle(PyTypeObject *cls, PyObject *name)
+{
+    Py_ssize_t len = PyUnicode_GET_LENGTH(name);
+    const char *prefix = cls->tp_name;
+
+    if (
+        (len > 2) &&
+        (PyUnicode_READ_CHAR(name, 0) == '_') &&
+        (PyUnicode_READ_CHAR(name, 1) == '_') &&
+        !(
+            (PyUnicode_READ_CHAR(name, (len - 1)) == '_') &&
+            (PyUnicode_READ_CHAR(name, (len - 2)) == '_')
+        )
+    ) {
+        if (strrchr(prefix, '.')) {
+            prefix = strrchr(prefix, '.') + 1;
+        }
+        while (*prefix == '_') {
+            prefix++;
+        }
+        if (*prefix) {
+            return PyUnicode_FromFormat("_%s%U", prefix, name);
+        }
+    }
+    return Py_NewRef(name);
+}
+
+
+static int
+__record_slots(module_state *state, PyTypeObject *cls, PyObject *fields)
+{
+    PyObject *slots = NULL, *fast = NULL, *name = NULL;
+    Py_ssize_t len, i;
+    int res = 0;
+
+    // borrowed
+    if (!(slots = PyDict_GetItemWithError(cls->tp_dict, state->str_slots))) {
+        return (PyErr_Occurred()) ? -1 : 0;
+    }
+    if (PyUnicode_Check(slots)) {
+        fast = PyTuple_Pack(1, slots);
+    }
+    else {
+        fast = PySequence_Fast(slots, "__slots__ must be a sequence");
+    }
+    if (!fast) {
+        return -1;
+    }
+    len = PySequence_Fast_GET_SIZE(fast);
+    for (i = 0; i < len; ++i) {
+        name = PySequence_Fast_GET_ITEM(fast, i);
+        if (!PyUnicode_Check(name)) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "__slots__ items must be strings, not '%.200s'",
+                Py_TYPE(name)->tp_name
+            );
+            res = -1;
+            break;
+        }
+        if (
+            !PyUnicode_CompareWithASCIIString(name, "__dict__") ||
+            !PyUnicode_CompareWithASCIIString(name, "__weakref__")
+        ) {
+            continue;
+        }
+        if (
+            !(name = __record_mangle(cls, name)) ||
+            (res = PyList_Append(fields, name))
+        ) {
+            Py_XDECREF(name);
+            res = -1;
+            break;
+        }
+        Py_DECREF(name);
+    }
+    Py_DECREF(fast);
+    return res;
+}
+
+
+/* the fields of a dataclass (in definition order) or the __slots__ of a class
+   and its bases (the ones of the bases first) */
+static PyObject *
+__record_fields(module_state *state, PyTypeObject *cls)
+{
+    PyObject *dataclasses = NULL, *fields = NULL, *result = NULL;
+    PyObject *name = NULL, *mro = cls->tp_mro;
+    Py_ssize_t len, i;
+
+    if (!(result = PyList_New(0))) {
+        return NULL;
+    }
+    if (_PyType_Lookup(cls, state->str_dataclass_fields)) {
+        if (
+            (dataclasses = PyImport_ImportModule("dataclasses")) &&
+            (
+                fields = PyObject_CallMethodOneArg(
+                    dataclasses, state->str_fields, _PyObject_CAST(cls)
+                )
+            )
+        ) {
+            len = PyTuple_GET_SIZE(fields);
+            for (i = 0; i < len; ++i) {
+                if (
+                    !(
+                        name = PyObject_GetAttr(
+                            PyTuple_GET_ITEM(fields, i), state->str_name
+                        )
+                    ) ||
+                    PyList_Append(result, name)
+                ) {
+                    Py_XDECREF(name);
+                    Py_CLEAR(result);
+                    break;
+                }
+                Py_DECREF(name);
+            }
+        }
+        else {
+            Py_CLEAR(result);
+        }
+        Py_XDECREF(fields);
+        Py_XDECREF(dataclasses);
+        return result;
+    }
+    for (i = PyTuple_GET_SIZE(mro); i-- > 0;) {
+        if (
+            __record_slots(
+                state, (PyTypeObject *)PyTuple_GET_ITEM(mro, i), result
+            )
+        ) {
+            Py_CLEAR(result);
+            break;
+        }
+    }
+    // instances without a __dict__ and no slots have no fields
+    if (result && !PyList_GET_SIZE(result) && cls->tp_dictoffset) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "cannot compile '%.200s' objects (not a dataclass and no "
+            "__slots__), fields must be declared",
+            cls->tp_name
+        );
+        Py_CLEAR(result);
+    }
+    return result;
+}
+
+
+/* the offset of the slot storing name, 0 if name is not a (writable) slot */
+static Py_ssize_t
+__record_offset(PyTypeObject *cls, PyObject *name)
+{
+    PyObject *descr = _PyType_Lookup(cls, name); // borrowed
+    PyMemberDef *member = NULL;
+
+    if (descr && Py_IS_TYPE(descr, &PyMemberDescr_Type)) {
+        member = ((PyMemberDescrObject *)descr)->d_member;
+        if (
+            (member->type == T_OBJECT_EX) &&
+            !(member->flags & READONLY) &&
+            (member->offset > 0)
+        ) {
+            return member->offset;
+        }
+    }
+    return 0;
+}
+
+
+static PyObject *
+_Record_New(module_state *state, PyTypeObject *cls, PyObject *fields)
+{
+    PyTypeObject *type = (PyTypeObject *)state->record_type;
+    Record *self = NULL;
+    PyObject *fast = NULL, *names = NULL, *name = NULL;
+    Py_ssize_t *offsets = NULL, len, i;
+    uint32_t tag = 0;
+
+    if (!cls->tp_new) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "cannot compile '%.200s' objects (not instantiable)",
+            cls->tp_name
+        );
+        return NULL;
+    }
+    if (__record_tag(state, cls, &tag)) {
+        return NULL;
+    }
+    if (!(fast = PySequence_Fast(fields, "fields must be a sequence"))) {
+        return NULL;
+    }
+    len = PySequence_Fast_GET_SIZE(fast);
+    if (
+        (names = PyTuple_New(len)) &&
+        (offsets = PyMem_New(Py_ssize_t, Py_MAX(len, 1)))
+    ) {
+        for (i = 0; i < len; ++i) {
+            name = PySequence_Fast_GET_ITEM(fast, i);
+            if (!PyUnicode_CheckExact(name)) {
+                PyErr_Format(
+                    PyExc_TypeError,
+                    "field names must be strings, not '%.200s'",
+                    Py_TYPE(name)->tp_name
+                );
+                break;
+            }
+            Py_INCREF(name);
+            PyUnicode_InternInPlace(&name);
+            PyTuple_SET_ITEM(names, i, name); // steals ref
+            offsets[i] = __record_offset(cls, name);
+        }
+        if (
+            (i == len) &&
+            (self = PyObject_GC_NEW(Record, type))
+        ) {
+            self->cls = (PyTypeObject *)Py_NewRef(cls);
+            self->fields = Py_NewRef(names);
+            self->offsets = offsets;
+            self->tag = tag;
+            offsets = NULL;
+            PyObject_GC_Track(self);
+        }
+    }
+    else if (names) {
+        PyErr_NoMemory();
+    }
+    PyMem_Free(offsets);
+    Py_XDECREF(names);
+    Py_DECREF(fast);
+    return _PyObject_CAST(self);
+}
+
+
+/* Record_Type -------------------------------------------------------------- */
+
+/* Record_Type.tp_traverse */
+static int
+Record_tp_traverse(Record *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self)); // heap type
+    Py_VISIT(self->cls);
+    Py_VISIT(self->fields);
+    return 0;
+}
+
+
+/* Record_Type.tp_clear */
+static int
+Record_tp_clear(Record *self)
+{
+    Py_CLEAR(self->fields);
+    Py_CLEAR(self->cls);
+    return 0;
+}
+
+
+/* Record_Type.tp_dealloc */
+static void
+Record_tp_dealloc(Record *self)
+{
+    PyObject_GC_UnTrack(self);
+    Record_tp_clear(self);
+    PyMem_Free(self->offsets);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
+}
+
+
+/* Record_Type.tp_repr */
+static PyObject *
+Record_tp_repr(Record *self)
+{
+    return PyUnicode_FromFormat(
+        "<%s %.200s, tag=0x%08x>",
+        Py_TYPE(self)->tp_name, self->cls->tp_name, self->tag
+    );
+}
+
+
+/* Record_Type.tp_members */
+static PyMemberDef Record_tp_members[] = {
+    {
+        "type", T_OBJECT, offsetof(Record, cls),
+        READONLY, NULL
+    },
+    {
+        "fields", T_OBJECT, offsetof(Record, fields),
+        READONLY, NULL
+    },
+    {
+        "tag", T_UINT, offsetof(Record, tag),
+        READONLY, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot Record_Slots[] = {
+    {Py_tp_doc, "compiled record codec (see compile())"},
+    {Py_tp_traverse, Record_tp_traverse},
+    {Py_tp_clear, Record_tp_clear},
+    {Py_tp_dealloc, Record_tp_dealloc},
+    {Py_tp_repr, Record_tp_repr},
+    {Py_tp_members, Record_tp_members},
+    {0, NULL}
+};
+
+
+PyType_Spec Record_Spec = {
+    .name = "mood.msgpack.Record",
+    .basicsize = sizeof(Record),
+    .flags = (
+        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC |
+        Py_TPFLAGS_DISALLOW_INSTANTIATION
+    ),
+    .slots = Record_Slots
+};
+
+
+/* --------------------------------------------------------------------------
+   interface
+   -------------------------------------------------------------------------- */
+
+PyObject *
+NewRecord(module_state *state, PyObject *cls, PyObject *fields)
+{
+    PyObject *self = NULL;
+
+    if (!PyType_Check(cls)) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "expected a class, not '%.200s'", Py_TYPE(cls)->tp_name
+        );
+        return NULL;
+    }
+    if (fields && (fields != Py_None)) {
+        return _Record_New(state, (PyTypeObject *)cls, fields);
+    }
+    if ((fields = __record_fields(state, (PyTypeObject *)cls))) {
+        self = _Record_New(state, (PyTypeObject *)cls, fields);
+        Py_DECREF(fields);
+    }
+    return self;
+}
+
+
+PyObject *
+RecordGetField(Record *self, PyObject *obj, Py_ssize_t i)
+{
+    PyObject *name = PyTuple_GET_ITEM(self->fields, i), *result = NULL;
+
+    if (self->offsets[i]) {
+        if (!(result = *(PyObject **)((char *)obj + self->offsets[i]))) {
+            PyErr_Format(
+                PyExc_AttributeError,
+                "'%.200s' object has no attribute '%U'",
+                Py_TYPE(obj)->tp_name, name
+            );
+            return NULL;
+        }
+        return Py_NewRef(result);
+    }
+    return PyObject_GetAttr(obj, name);
+}
+
+
+PyObject *
+RecordNewInstance(Record *self)
+{
+    PyObject *args = NULL, *result = NULL;
+
+    if ((args = PyTuple_New(0))) {
+        result = self->cls->tp_new(self->cls, args, NULL);
+        Py_DECREF(args);
+    }
+    return result;
+}
+
+
+int
+RecordSetField(Record *self, PyObject *obj, Py_ssize_t i, PyObject *value)
+{
+    PyObject **slot = NULL;
+
+    if (self->offsets[i]) {
+        slot = (PyObject **)((char *)obj + self->offsets[i]);
+        Py_XSETREF(*slot, Py_NewRef(value));
+        return 0;
+    }
+    return PyObject_GenericSetAttr(
+        obj, PyTuple_GET_ITEM(self->fields, i), value
+    );
+}
+
+
+/* a class compiled again replaces its previous record, two classes cannot
+   share a tag */
+int
+RegisterRecord(module_state *state, PyObject *record)
+{
+    Record *self = (Record *)record, *other = NULL;
+    char tag[MSGPACK_RECORD_TAG];
+    uint32_t value = htobe32(self->tag);
+
+    memcpy(tag, &value, MSGPACK_RECORD_TAG);
+    other = (Record *)RegistryGet(
+        &state->record_tags, tag, MSGPACK_RECORD_TAG
+    ); // borrowed
+    if (other && (other->cls != self->cls)) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "'%.200s' and '%.200s' have the same tag (0x%08x)",
+            self->cls->tp_name, other->cls->tp_name, self->tag
+        );
+        return -1;
+    }
+    if (
+        RegistrySet(&state->record_tags, tag, MSGPACK_RECORD_TAG, record) ||
+        PyDict_SetItem(state->records, _PyObject_CAST(self->cls), record)
+    ) {
+        return -1;
+    }
+    return 0;
+}
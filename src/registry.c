@@ -0,0 +1,158 @@
+#include "msgpack.h"
+
+
+/* --------------------------------------------------------------------------
+   registry
+   -------------------------------------------------------------------------- */
+
+/* open addressing (linear probing) table keyed on the packed representation
+   of registered objects, lookups hash the key in place in the message */
+
+#define MSGPACK_REGISTRY_MIN_SIZE 16
+
+
+static inline registry_entry *
+__registry_lookup(
+    registry_entry *entries,
+    Py_ssize_t mask,
+    const char *key,
+    Py_ssize_t len,
+    Py_hash_t hash
+)
+{
+    registry_entry *entry = NULL;
+    size_t i = (size_t)hash & mask;
+
+    for (;; i = ((i + 1) & mask)) {
+        entry = &entries[i];
+        if (
+            !entry->key ||
+            (
+                (entry->hash == hash) &&
+                (entry->len == len) &&
+                !memcmp(entry->key, key, len)
+            )
+        ) {
+            return entry;
+        }
+    }
+}
+
+
+static int
+__registry_resize(registry_table *registry)
+{
+    Py_ssize_t alloc = 0, i;
+    registry_entry *entries = NULL, *entry = NULL, *old = NULL;
+
+    alloc = (registry->mask) ? ((registry->mask + 1) << 1) :
+        MSGPACK_REGISTRY_MIN_SIZE;
+    if (!(entries = PyMem_Calloc(alloc, sizeof(registry_entry)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (registry->entries) {
+        for (i = 0; i <= registry->mask; ++i) {
+            if ((old = &registry->entries[i])->key) {
+                entry = __registry_lookup(
+                    entries, (alloc - 1), old->key, old->len, old->hash
+                );
+                *entry = *old;
+            }
+        }
+        PyMem_Free(registry->entries);
+    }
+    registry->entries = entries;
+    registry->mask = alloc - 1;
+    return 0;
+}
+
+
+/* --------------------------------------------------------------------------
+   interface
+   -------------------------------------------------------------------------- */
+
+int
+RegistrySet(
+    registry_table *registry, const char *key, Py_ssize_t len, PyObject *obj
+)
+{
+    registry_entry *entry = NULL;
+    Py_hash_t hash = _Py_HashBytes(key, len);
+    char *_key_ = NULL;
+
+    // keep the load factor under 2/3
+    if (
+        (((registry->size + 1) * 3) > ((registry->mask + 1) * 2)) &&
+        __registry_resize(registry)
+    ) {
+        return -1;
+    }
+    entry = __registry_lookup(
+        registry->entries, registry->mask, key, len, hash
+    );
+    if (entry->key) {
+        Py_SETREF(entry->value, Py_NewRef(obj));
+        return 0;
+    }
+    if (!(_key_ = PyMem_Malloc(Py_MAX(len, 1)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(_key_, key, len);
+    entry->hash = hash;
+    entry->len = len;
+    entry->key = _key_;
+    entry->value = Py_NewRef(obj);
+    registry->size++;
+    return 0;
+}
+
+
+PyObject *
+RegistryGet(registry_table *registry, const char *key, Py_ssize_t len)
+{
+    registry_entry *entry = NULL;
+
+    if (!registry->entries) {
+        return NULL;
+    }
+    entry = __registry_lookup(
+        registry->entries, registry->mask, key, len, _Py_HashBytes(key, len)
+    );
+    return entry->value; // borrowed
+}
+
+
+int
+RegistryTraverse(registry_table *registry, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    if (registry->entries) {
+        for (i = 0; i <= registry->mask; ++i) {
+            Py_VISIT(registry->entries[i].value);
+        }
+    }
+    return 0;
+}
+
+
+void
+RegistryClear(registry_table *registry)
+{
+    registry_entry *entry = NULL;
+    Py_ssize_t i;
+
+    if (registry->entries) {
+        for (i = 0; i <= registry->mask; ++i) {
+            if ((entry = &registry->entries[i])->key) {
+                Py_CLEAR(entry->value);
+                PyMem_Free(entry->key);
+            }
+        }
+        PyMem_Free(registry->entries);
+        registry->entries = NULL;
+    }
+    registry->size = registry->mask = 0;
+}
@@ -1,5 +1,9 @@
 #include "msgpack.h"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 
 #define __PyErr_SetTypeState__(s, d, t) \
     PyErr_Format(PyExc_TypeError, #s " %s type: '0x%02x'", (d) ? d : "\b", t)
@@ -112,11 +116,146 @@ __unpack_type(Py_buffer *msg, Py_ssize_t *off)
     PyFloat_FromDouble(__unpack_float##s(b))
 
 
+/* -------------------------------------------------------------------------- */
+
+#define MSGPACK_ASCII_MASK 0x8080808080808080ULL
+
+
+static inline int
+__is_ascii(const char *buffer, Py_ssize_t size)
+{
+    const char *end = buffer + size;
+    uint64_t word = 0;
+
+#if defined(__AVX2__)
+    for (; (end - buffer) >= 32; buffer += 32) {
+        if (
+            _mm256_movemask_epi8(
+                _mm256_loadu_si256((const __m256i *)buffer)
+            )
+        ) {
+            return 0;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; (end - buffer) >= 16; buffer += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)buffer))) {
+            return 0;
+        }
+    }
+#endif
+    for (; (end - buffer) >= 8; buffer += 8) {
+        memcpy(&word, buffer, 8);
+        if (word & MSGPACK_ASCII_MASK) {
+            return 0;
+        }
+    }
+    for (; buffer < end; ++buffer) {
+        if (*buffer & 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* the ascii payload is copied as is into a compact (1 byte kind) str */
+static inline PyObject *
+__unpack_ascii(const char *buffer, Py_ssize_t size)
+{
+    PyObject *result = NULL;
+
+    if ((result = PyUnicode_New(size, 127))) {
+        memcpy(PyUnicode_1BYTE_DATA(result), buffer, size);
+    }
+    return result;
+}
+
+
+#define PyStr_FromStringAndSize(b, s) \
+    ( \
+        __is_ascii(b, s) ? \
+        __unpack_ascii(b, s) : PyUnicode_DecodeUTF8(b, s, NULL) \
+    )
+
+
+/* memo --------------------------------------------------------------------- */
+
+/* while unpacking a memoized message (see _PyMemo_Unpack()) containers and
+   reduced objects are memoized in the order they were when packing, their
+   slot is reserved (NULL) while they cannot be referenced yet */
+
+/* returns the index of obj (NULL to reserve a slot) */
+static inline Py_ssize_t
+__memo_append(unpack_memo *memo, PyObject *obj)
+{
+    PyObject **items = NULL;
+    Py_ssize_t alloc = 0;
+
+    if (memo->len == memo->alloc) {
+        alloc = (memo->alloc) ? (memo->alloc << 1) : 16;
+        if (!(items = PyMem_Resize(memo->items, PyObject *, alloc))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memo->items = items;
+        memo->alloc = alloc;
+    }
+    memo->items[memo->len] = Py_XNewRef(obj);
+    return memo->len++;
+}
+
+
+static inline int
+__memo_reserve(unpack_context *context, Py_ssize_t *index)
+{
+    if (!context->memo) {
+        return 0;
+    }
+    return ((*index = __memo_append(context->memo, NULL)) < 0) ? -1 : 0;
+}
+
+
+static inline int
+__memo_set(unpack_context *context, Py_ssize_t index, PyObject *obj)
+{
+    if (index >= 0) {
+        context->memo->items[index] = Py_NewRef(obj);
+    }
+    return 0;
+}
+
+
+static inline int
+__memo_add(unpack_context *context, PyObject *obj)
+{
+    Py_ssize_t index = -1;
+
+    if (__memo_reserve(context, &index)) {
+        return -1;
+    }
+    return __memo_set(context, index, obj);
+}
+
+
+/* while unpacking a deduplicated message (see _PyStrings_Unpack()) every str
+   is indexed, str references return the very same object */
+static inline PyObject *
+__unpack_string(unpack_context *context, PyObject *str)
+{
+    if (str && context->strings && (__memo_append(context->strings, str) < 0)) {
+        Py_CLEAR(str);
+    }
+    return str;
+}
+
+
 /* -------------------------------------------------------------------------- */
 
 static inline int
 __unpack_sequence(
-    PyObject *module,
+    unpack_context *context,
     Py_buffer *msg,
     Py_ssize_t *off,
     Py_ssize_t size,
@@ -128,7 +267,7 @@ __unpack_sequence(
     int res = 0;
 
     for (i = 0; i < size; ++i) {
-        if ((res = ((item = UnpackMessage(module, msg, off)) ? 0 : -1))) {
+        if ((res = ((item = UnpackMessage(context, msg, off)) ? 0 : -1))) {
             break;
         }
         items[i] = item; // steals ref
@@ -137,9 +276,69 @@ __unpack_sequence(
 }
 
 
+/* short ascii keys (fixstr) are looked up in a direct-mapped cache of
+   interned strings keyed on their raw bytes, on collision the cached string
+   is replaced */
+static inline PyObject *
+__unpack_cached_key(PyObject **cache, const char *buffer, Py_ssize_t size)
+{
+    PyObject *key = NULL, **entry = NULL;
+    uint32_t hash = 2166136261u; // FNV-1a
+    Py_ssize_t i;
+
+    for (i = 0; i < size; ++i) {
+        if (buffer[i] & 0x80) {
+            return PyUnicode_DecodeUTF8(buffer, size, NULL);
+        }
+        hash = (hash ^ (uint8_t)buffer[i]) * 16777619u;
+    }
+    entry = &cache[hash & (MSGPACK_KEY_CACHE_SIZE - 1)];
+    if (
+        (key = *entry) &&
+        (PyUnicode_GET_LENGTH(key) == size) &&
+        !memcmp(PyUnicode_DATA(key), buffer, size)
+    ) {
+        return Py_NewRef(key);
+    }
+    if ((key = __unpack_ascii(buffer, size))) {
+        PyUnicode_InternInPlace(&key);
+        PyObject_Hash(key); // cannot fail, cached by str
+        Py_XSETREF(*entry, Py_NewRef(key));
+    }
+    return key;
+}
+
+
+static inline PyObject *
+__unpack_key(unpack_context *context, Py_buffer *msg, Py_ssize_t *off)
+{
+    const char *buffer = NULL;
+    Py_ssize_t poff = *off + 1, size = 0;
+    uint8_t type = MSGPACK_INVALID;
+
+    if (
+        (context->flags & MSGPACK_UNPACK_CACHE_KEYS) &&
+        (*off < msg->len) &&
+        (MSGPACK_FIXSTR <= (type = ((uint8_t *)msg->buf)[*off])) &&
+        (type <= MSGPACK_FIXSTR_END)
+    ) {
+        size = (type & MSGPACK_FIXSTR_BIT);
+        if (!(buffer = __unpack_buffer(msg, &poff, size))) {
+            return NULL;
+        }
+        *off = poff;
+        return __unpack_string(
+            context,
+            __unpack_cached_key(context->state->key_cache, buffer, size)
+        );
+    }
+    return UnpackMessage(context, msg, off);
+}
+
+
 static inline int
 __unpack_dict(
-    PyObject *module,
+    unpack_context *context,
     Py_buffer *msg,
     Py_ssize_t *off,
     Py_ssize_t size,
@@ -151,12 +350,13 @@ __unpack_dict(
     int res = 0;
 
     for (i = 0; i < size; ++i) {
+        key = val = NULL;
         if (
             (
                 res = (
                     (
-                        (key = UnpackMessage(module, msg, off)) &&
-                        (val = UnpackMessage(module, msg, off))
+                        (key = __unpack_key(context, msg, off)) &&
+                        (val = UnpackMessage(context, msg, off))
                     ) ? PyDict_SetItem(items, key, val) : -1
                 )
             )
@@ -194,8 +394,8 @@ __unpack_dict(
     (((size = __unpack_size__(m, o, s)) < 0) ? NULL : _##t##_Unpack(m, o, size))
 
 
-#define __unpack_size_mod(t, _mod_, m, o, s) \
-    (((size = __unpack_size__(m, o, s)) < 0) ? NULL : _##t##_Unpack(_mod_, m, o, size))
+#define __unpack_size_ctx(t, _ctx_, m, o, s) \
+    (((size = __unpack_size__(m, o, s)) < 0) ? NULL : _##t##_Unpack(_ctx_, m, o, size))
 
 
 /* MSGPACK_UINT ------------------------------------------------------------- */
@@ -218,17 +418,85 @@ __unpack_dict(
 
 /* MSGPACK_BIN -------------------------------------------------------------- */
 
-#define _PyBytes_Unpack(m, o, s) \
-    __unpack_object(PyBytes, m, o, s)
+/* with MSGPACK_UNPACK_BIN_VIEWS, binary data is returned as slices of a
+   (lazily created) read-only memoryview of the message, they keep it exported
+   for as long as they live, messages without an exporter are still copied */
+static PyObject *
+__unpack_view(
+    unpack_context *context,
+    Py_buffer *msg,
+    const char *buffer,
+    Py_ssize_t size
+)
+{
+    module_state *state = context->state;
+    PyObject *view = NULL, *format = NULL;
+    Py_ssize_t start = 0;
+
+    if (!context->view) {
+        if (!(view = PyMemoryView_FromObject(msg->obj))) {
+            return NULL;
+        }
+        if (
+            strcmp(PyMemoryView_GET_BUFFER(view)->format, "B") ||
+            (PyMemoryView_GET_BUFFER(view)->ndim != 1)
+        ) {
+            if ((format = PyUnicode_FromOrdinal('B'))) {
+                Py_SETREF(
+                    view,
+                    PyObject_CallMethodOneArg(view, state->str_cast, format)
+                );
+                Py_DECREF(format);
+            }
+            else {
+                Py_CLEAR(view);
+            }
+        }
+        if (view) {
+            context->view = PyObject_CallMethodNoArgs(
+                view, state->str_toreadonly
+            );
+            Py_DECREF(view);
+        }
+        if (!context->view) {
+            return NULL;
+        }
+    }
+    start = buffer - (const char *)PyMemoryView_GET_BUFFER(context->view)->buf;
+    return PySequence_GetSlice(context->view, start, (start + size));
+}
+
+
+#define __unpack_binary(t, _ctx_, m, o, s) \
+    ( \
+        ( \
+            buffer = __unpack_buffer(m, o, s) \
+        ) ? ( \
+            ((_ctx_->flags & MSGPACK_UNPACK_BIN_VIEWS) && m->obj) ? \
+            __unpack_view(_ctx_, m, buffer, s) : \
+            t##_FromStringAndSize(buffer, s) \
+        ) : NULL \
+    )
+
+
+static PyObject *
+_PyBytes_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    const char *buffer = NULL;
+
+    return __unpack_binary(PyBytes, context, msg, off, size);
+}
 
-#define _PyBytes_Unpack_(m, o, s) \
-    __unpack_size(PyBytes, m, o, s)
+#define _PyBytes_Unpack_(_ctx_, m, o, s) \
+    __unpack_size_ctx(PyBytes, _ctx_, m, o, s)
 
 
 /* MSGPACK_STR, MSGPACK_FIXSTR ---------------------------------------------- */
 
 #define _PyUnicode_Unpack(m, o, s) \
-    __unpack_object(PyUnicode, m, o, s)
+    __unpack_object(PyStr, m, o, s)
 
 #define _PyUnicode_Unpack_(m, o, s) \
     __unpack_size(PyUnicode, m, o, s)
@@ -238,7 +506,7 @@ __unpack_dict(
 
 static PyObject *
 _PyTuple_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
 )
 {
     PyObject *result = NULL;
@@ -246,7 +514,12 @@ _PyTuple_Unpack(
     if (!Py_EnterRecursiveCall(_Unpacking_("tuple"))) {
         if (
             (result = PyTuple_New(size)) &&
-            __unpack_sequence(module, msg, off, size, _PyTuple_ITEMS(result))
+            (
+                __unpack_sequence(
+                    context, msg, off, size, _PyTuple_ITEMS(result)
+                ) ||
+                __memo_add(context, result)
+            )
         ) {
             Py_CLEAR(result);
         }
@@ -255,15 +528,15 @@ _PyTuple_Unpack(
     return result;
 }
 
-#define _PyTuple_Unpack_(_mod_, m, o, s) \
-    __unpack_size_mod(PyTuple, _mod_, m, o, s)
+#define _PyTuple_Unpack_(_ctx_, m, o, s) \
+    __unpack_size_ctx(PyTuple, _ctx_, m, o, s)
 
 
 /* MSGPACK_MAP, MSGPACK_FIXMAP ---------------------------------------------- */
 
 static PyObject *
 _PyDict_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
 )
 {
     PyObject *result = NULL;
@@ -271,7 +544,10 @@ _PyDict_Unpack(
     if (!Py_EnterRecursiveCall(_Unpacking_("dict"))) {
         if (
             (result = PyDict_New()) &&
-            __unpack_dict(module, msg, off, size, result)
+            (
+                __memo_add(context, result) ||
+                __unpack_dict(context, msg, off, size, result)
+            )
         ) {
             Py_CLEAR(result);
         }
@@ -280,8 +556,8 @@ _PyDict_Unpack(
     return result;
 }
 
-#define _PyDict_Unpack_(_mod_, m, o, s) \
-    __unpack_size_mod(PyDict, _mod_, m, o, s)
+#define _PyDict_Unpack_(_ctx_, m, o, s) \
+    __unpack_size_ctx(PyDict, _ctx_, m, o, s)
 
 
 /* --------------------------------------------------------------------------
@@ -290,7 +566,7 @@ _PyDict_Unpack(
 
 static inline int
 __unpack_anyset(
-    PyObject *module,
+    unpack_context *context,
     Py_buffer *msg,
     Py_ssize_t *off,
     Py_ssize_t size,
@@ -306,7 +582,7 @@ __unpack_anyset(
             (
                 res = (
                     (
-                        item = UnpackMessage(module, msg, off)
+                        item = UnpackMessage(context, msg, off)
                     ) ? PySet_Add(items, item) : -1
                 )
             )
@@ -320,24 +596,51 @@ __unpack_anyset(
 }
 
 
+static inline int
+__unpack_list(
+    unpack_context *context,
+    Py_buffer *msg,
+    Py_ssize_t *off,
+    Py_ssize_t size,
+    PyObject *items
+)
+{
+    PyObject *item = NULL;
+    Py_ssize_t i;
+    int res = 0;
+
+    for (i = 0; i < size; ++i) {
+        if (
+            (
+                res = (
+                    (
+                        item = UnpackMessage(context, msg, off)
+                    ) ? PyList_Append(items, item) : -1
+                )
+            )
+        ) {
+            Py_XDECREF(item);
+            break;
+        }
+        Py_DECREF(item);
+    }
+    return res;
+}
+
+
 static inline PyObject *
 __unpack_registered(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
 )
 {
     const char *buffer = NULL;
-    module_state *state = NULL;
-    PyObject *result = NULL, *key = NULL;
+    PyObject *result = NULL;
 
     if (
         (buffer = __unpack_buffer(msg, off, size)) &&
-        (state = __PyModule_GetState__(module)) &&
-        (key = PyBytes_FromStringAndSize(buffer, size))
+        (result = RegistryGet(&context->state->registry, buffer, size)) // borrowed
     ) {
-        if ((result = PyDict_GetItem(state->registry, key))) { // borrowed
-            Py_INCREF(result);
-        }
-        Py_DECREF(key);
+        Py_INCREF(result);
     }
     return result;
 }
@@ -372,24 +675,55 @@ __unpack_len__(Py_buffer *msg, Py_ssize_t *off)
     (((len = __unpack_len__(m, o)) < 0) ? NULL : _##t##_Unpack(r, m, o, len))
 
 
+/* a map that is part of an extension (never memoized) */
+static PyObject *
+__unpack_map(unpack_context *context, Py_buffer *msg, Py_ssize_t *off)
+{
+    uint8_t type = MSGPACK_INVALID;
+    const char *buffer = NULL;
+    Py_ssize_t len = -1;
+    PyObject *result = NULL;
+
+    if ((type = __unpack_type(msg, off)) == MSGPACK_INVALID) {
+        _PyErr_InvalidType_("map", type);
+    }
+    else if ((MSGPACK_FIXMAP <= type) && (type <= MSGPACK_FIXMAP_END)) {
+        len = (type & MSGPACK_FIXOBJ_BIT);
+    }
+    else if (type == MSGPACK_MAP2) {
+        len = __unpack_size__(msg, off, 2);
+    }
+    else if (type == MSGPACK_MAP4) {
+        len = __unpack_size__(msg, off, 4);
+    }
+    else {
+        __PyErr_InvalidType__("map", type);
+    }
+    if (
+        (len >= 0) &&
+        (result = PyDict_New()) &&
+        __unpack_dict(context, msg, off, len, result)
+    ) {
+        Py_CLEAR(result);
+    }
+    return result;
+}
+
+
 /* MSGPACK_EXT_TIMESTAMP ---------------------------------------------------- */
 
 static PyObject *
 _Timestamp_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
 )
 {
-    module_state *state = NULL;
     const char *buffer = NULL;
     uint32_t nanoseconds = 0;
     int64_t seconds = 0;
     uint64_t value = 0;
     PyObject *result = NULL;
 
-    if (
-        (state = __PyModule_GetState__(module)) &&
-        (buffer = __unpack_buffer(msg, off, size))
-    ) {
+    if ((buffer = __unpack_buffer(msg, off, size))) {
         if (size == 4) {
             seconds = (int64_t)__unpack_uint4(buffer);
         }
@@ -405,7 +739,9 @@ _Timestamp_Unpack(
         else {
             return _PyErr_InvalidSize_("timestamp", size);
         }
-        result = NewTimestamp(state->timestamp_type, seconds, nanoseconds);
+        result = NewTimestamp(
+            context->state->timestamp_type, seconds, nanoseconds
+        );
     }
     return result;
 }
@@ -434,108 +770,338 @@ _PyComplex_Unpack(Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size)
 
 /* MSGPACK_EXT_PYBYTEARRAY -------------------------------------------------- */
 
-#define _PyByteArray_Unpack(m, o, s) \
-    __unpack_object(PyByteArray, m, o, s)
-
-
-/* MSGPACK_EXT_PYLIST ------------------------------------------------------- */
-
 static PyObject *
-_PyList_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+_PyByteArray_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
 )
 {
-    PyObject *result = NULL;
+    const char *buffer = NULL;
 
-    if (!Py_EnterRecursiveCall(_Unpacking_("list"))) {
-        if (
-            (result = PyList_New(size)) &&
-            __unpack_sequence(module, msg, off, size, _PyList_ITEMS(result))
-        ) {
-            Py_CLEAR(result);
-        }
-        Py_LeaveRecursiveCall();
-    }
-    return result;
+    return __unpack_binary(PyByteArray, context, msg, off, size);
 }
 
-#define _PyList_Unpack_(r, m, o) \
-    __unpack_len(PyList, r, m, o)
 
+/* MSGPACK_EXT_PYARRAY, MSGPACK_EXT_PYMEMORYVIEW ---------------------------- */
 
-/* MSGPACK_EXT_PYSET -------------------------------------------------------- */
-
-static PyObject *
-_PySet_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
-)
+/* the loops are simple enough for the compiler to vectorize them */
+static inline void
+__byteswap(char *buffer, Py_ssize_t len, Py_ssize_t itemsize)
 {
-    PyObject *result = NULL;
+    uint16_t v2;
+    uint32_t v4;
+    uint64_t v8;
+    Py_ssize_t i;
 
-    if (!Py_EnterRecursiveCall(_Unpacking_("set"))) {
-        if (
-            (result = PySet_New(NULL)) &&
-            __unpack_anyset(module, msg, off, size, result)
-        ) {
-            Py_CLEAR(result);
-        }
-        Py_LeaveRecursiveCall();
+    switch (itemsize) {
+        case 2:
+            for (i = 0; i < len; i += 2) {
+                memcpy(&v2, (buffer + i), 2);
+                v2 = __builtin_bswap16(v2);
+                memcpy((buffer + i), &v2, 2);
+            }
+            break;
+        case 4:
+            for (i = 0; i < len; i += 4) {
+                memcpy(&v4, (buffer + i), 4);
+                v4 = __builtin_bswap32(v4);
+                memcpy((buffer + i), &v4, 4);
+            }
+            break;
+        case 8:
+            for (i = 0; i < len; i += 8) {
+                memcpy(&v8, (buffer + i), 8);
+                v8 = __builtin_bswap64(v8);
+                memcpy((buffer + i), &v8, 8);
+            }
+            break;
     }
-    return result;
 }
 
-#define _PySet_Unpack_(r, m, o) \
-    __unpack_len(PySet, r, m, o)
 
+static inline Py_ssize_t
+__typed_itemsize(char typecode)
+{
+    switch (typecode) {
+        case 'b':
+        case 'B':
+            return 1;
+        case 'h':
+        case 'H':
+            return sizeof(short);
+        case 'i':
+        case 'I':
+            return sizeof(int);
+        case 'l':
+        case 'L':
+            return sizeof(long);
+        case 'q':
+        case 'Q':
+            return sizeof(long long);
+        case 'f':
+            return sizeof(float);
+        case 'd':
+            return sizeof(double);
+    }
+    return -1;
+}
 
-/* MSGPACK_EXT_PYFROZENSET -------------------------------------------------- */
 
-static PyObject *
-_PyFrozenSet_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+/* returns the data following the header, *size is set to its length */
+static const char *
+__unpack_typed(
+    Py_buffer *msg,
+    Py_ssize_t *off,
+    Py_ssize_t *size,
+    char *typecode,
+    int *swap,
+    const char *name
 )
 {
-    PyObject *result = NULL;
+    const char *buffer = NULL;
+    Py_ssize_t itemsize = 0;
 
-    if (!Py_EnterRecursiveCall(_Unpacking_("frozenset"))) {
-        if (
-            (result = PyFrozenSet_New(NULL)) &&
-            __unpack_anyset(module, msg, off, size, result)
-        ) {
-            Py_CLEAR(result);
-        }
-        Py_LeaveRecursiveCall();
+    if (*size < MSGPACK_TYPED_HEADER) {
+        _PyErr_InvalidSize_(name, *size);
+        return NULL;
     }
-    return result;
+    if (!(buffer = __unpack_buffer(msg, off, *size))) {
+        return NULL;
+    }
+    *typecode = buffer[0];
+    *size -= MSGPACK_TYPED_HEADER;
+    if (
+        ((itemsize = __typed_itemsize(*typecode)) < 0) ||
+        (itemsize != (uint8_t)buffer[1]) ||
+        ((buffer[2] != '<') && (buffer[2] != '>')) ||
+        (*size % itemsize)
+    ) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "invalid %s header: typecode '%c', itemsize %d, byteorder '%c'",
+            name, buffer[0], (uint8_t)buffer[1], buffer[2]
+        );
+        return NULL;
+    }
+    *swap = ((itemsize > 1) && (buffer[2] != MSGPACK_TYPED_BYTEORDER));
+    return (buffer + MSGPACK_TYPED_HEADER);
 }
 
-#define _PyFrozenSet_Unpack_(r, m, o) \
-    __unpack_len(PyFrozenSet, r, m, o)
-
-
-/* MSGPACK_EXT_PYCLASS ------------------------------------------------------ */
 
-static inline void
-__unpack_class_error(PyObject *module, Py_buffer *msg, Py_ssize_t *off)
+static PyObject *
+_PyArray_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    const char *buffer = NULL;
+    PyObject *result = NULL, *data = NULL, *res = NULL;
+    Py_buffer view;
+    char typecode = 0;
+    int swap = 0;
+
+    if (
+        !(
+            buffer = __unpack_typed(
+                msg, off, &size, &typecode, &swap, "array.array"
+            )
+        ) ||
+        !(
+            result = PyObject_CallFunction(
+                context->state->array_type, "C", typecode
+            )
+        )
+    ) {
+        return NULL;
+    }
+    if (
+        (
+            data = PyMemoryView_FromMemory(
+                (char *)buffer, size, PyBUF_READ
+            )
+        )
+    ) {
+        res = PyObject_CallMethodOneArg(
+            result, context->state->str_frombytes, data
+        );
+        Py_DECREF(data);
+    }
+    if (!res) {
+        Py_CLEAR(result);
+    }
+    else {
+        Py_DECREF(res);
+        if (swap) {
+            if (PyObject_GetBuffer(result, &view, PyBUF_WRITABLE)) {
+                Py_CLEAR(result);
+            }
+            else {
+                __byteswap(view.buf, view.len, view.itemsize);
+                PyBuffer_Release(&view);
+            }
+        }
+    }
+    return result;
+}
+
+
+static PyObject *
+_PyMemoryView_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    const char *buffer = NULL;
+    PyObject *result = NULL, *data = NULL, *view = NULL, *format = NULL;
+    char typecode = 0;
+    int swap = 0;
+
+    if (
+        (
+            buffer = __unpack_typed(
+                msg, off, &size, &typecode, &swap, "memoryview"
+            )
+        ) &&
+        (data = PyBytes_FromStringAndSize(buffer, size))
+    ) {
+        if (swap) {
+            __byteswap(
+                PyBytes_AS_STRING(data), size, __typed_itemsize(typecode)
+            );
+        }
+        if (
+            (view = PyMemoryView_FromObject(data)) &&
+            (format = PyUnicode_FromOrdinal(typecode))
+        ) {
+            result = PyObject_CallMethodOneArg(
+                view, context->state->str_cast, format
+            );
+        }
+        Py_XDECREF(format);
+        Py_XDECREF(view);
+        Py_DECREF(data);
+    }
+    return result;
+}
+
+
+/* MSGPACK_EXT_PYLIST ------------------------------------------------------- */
+
+static PyObject *
+_PyList_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    PyObject *result = NULL;
+
+    if (!Py_EnterRecursiveCall(_Unpacking_("list"))) {
+        if (context->memo) {
+            // the list can be referenced (and used) while it is filled
+            if (
+                (result = PyList_New(0)) &&
+                (
+                    __memo_add(context, result) ||
+                    __unpack_list(context, msg, off, size, result)
+                )
+            ) {
+                Py_CLEAR(result);
+            }
+        }
+        else if (
+            (result = PyList_New(size)) &&
+            __unpack_sequence(context, msg, off, size, _PyList_ITEMS(result))
+        ) {
+            Py_CLEAR(result);
+        }
+        Py_LeaveRecursiveCall();
+    }
+    return result;
+}
+
+#define _PyList_Unpack_(r, m, o) \
+    __unpack_len(PyList, r, m, o)
+
+
+/* MSGPACK_EXT_PYSET -------------------------------------------------------- */
+
+static PyObject *
+_PySet_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    PyObject *result = NULL;
+
+    if (!Py_EnterRecursiveCall(_Unpacking_("set"))) {
+        if (
+            (result = PySet_New(NULL)) &&
+            (
+                __memo_add(context, result) ||
+                __unpack_anyset(context, msg, off, size, result)
+            )
+        ) {
+            Py_CLEAR(result);
+        }
+        Py_LeaveRecursiveCall();
+    }
+    return result;
+}
+
+#define _PySet_Unpack_(r, m, o) \
+    __unpack_len(PySet, r, m, o)
+
+
+/* MSGPACK_EXT_PYFROZENSET -------------------------------------------------- */
+
+static PyObject *
+_PyFrozenSet_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    PyObject *result = NULL;
+
+    if (!Py_EnterRecursiveCall(_Unpacking_("frozenset"))) {
+        if (
+            (result = PyFrozenSet_New(NULL)) &&
+            (
+                __unpack_anyset(context, msg, off, size, result) ||
+                __memo_add(context, result)
+            )
+        ) {
+            Py_CLEAR(result);
+        }
+        Py_LeaveRecursiveCall();
+    }
+    return result;
+}
+
+#define _PyFrozenSet_Unpack_(r, m, o) \
+    __unpack_len(PyFrozenSet, r, m, o)
+
+
+/* MSGPACK_EXT_PYCLASS ------------------------------------------------------ */
+
+static inline void
+__unpack_class_error(unpack_context *context, Py_buffer *msg, Py_ssize_t *off)
 {
     _Py_IDENTIFIER(builtins);
     PyObject *_modname_ = NULL, *_qualname_ = NULL;
 
     if (
-        (_modname_ = UnpackMessage(module, msg, off)) &&
-        (_qualname_ = UnpackMessage(module, msg, off))
+        (_modname_ = UnpackMessage(context, msg, off)) &&
+        (_qualname_ = UnpackMessage(context, msg, off))
     ) {
-        if (!_PyUnicode_EqualToASCIIId(_modname_, &PyId_builtins)) {
+        // a corrupted message may hold anything but strs
+        if (
+            !PyUnicode_Check(_modname_) ||
+            !_PyUnicode_EqualToASCIIId(_modname_, &PyId_builtins)
+        ) {
             PyErr_Format(
                 PyExc_TypeError,
-                "cannot unpack <class '%U.%U'>",
+                "cannot unpack <class '%S.%S'>",
                 _modname_,
                 _qualname_
             );
         }
         else {
             PyErr_Format(
-                PyExc_TypeError, "cannot unpack <class '%U'>", _qualname_
+                PyExc_TypeError, "cannot unpack <class '%S'>", _qualname_
             );
         }
     }
@@ -545,48 +1111,80 @@ __unpack_class_error(PyObject *module, Py_buffer *msg, Py_ssize_t *off)
 
 static PyObject *
 _PyClass_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
 )
 {
     Py_ssize_t poff = *off; // keep the original offset in case of error
     PyObject *result = NULL;
 
     if (
-        !(result = __unpack_registered(module, msg, off, size)) &&
+        !(result = __unpack_registered(context, msg, off, size)) &&
         !PyErr_Occurred()
     ) {
-        __unpack_class_error(module, msg, &poff);
+        __unpack_class_error(context, msg, &poff);
     }
     return result;
 }
 
 
+/* MSGPACK_EXT_PYCLASSID ---------------------------------------------------- */
+
+static PyObject *
+_PyClassId_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    module_state *state = context->state;
+    const char *buffer = NULL;
+    Py_ssize_t id = -1;
+    PyObject *result = NULL;
+
+    switch (size) {
+        case 1:
+            id = __unpack_size__(msg, off, 1);
+            break;
+        case 2:
+            id = __unpack_size__(msg, off, 2);
+            break;
+        default:
+            return _PyErr_InvalidSize_("class id", size);
+    }
+    if (id < 0) {
+        return NULL;
+    }
+    if ((id >= state->nclasses) || !(result = state->classes[id])) {
+        PyErr_Format(PyExc_TypeError, "cannot unpack class id %zd", id);
+    }
+    return Py_XNewRef(result);
+}
+
+
 /* MSGPACK_EXT_PYSINGLETON -------------------------------------------------- */
 
 static inline void
-__unpack_singleton_error(PyObject *module, Py_buffer *msg, Py_ssize_t *off)
+__unpack_singleton_error(unpack_context *context, Py_buffer *msg, Py_ssize_t *off)
 {
     PyObject *name = NULL;
 
-    if ((name = UnpackMessage(module, msg, off))) {
-        PyErr_Format(PyExc_TypeError, "cannot unpack '%U'", name);
+    if ((name = UnpackMessage(context, msg, off))) {
+        PyErr_Format(PyExc_TypeError, "cannot unpack '%S'", name);
         Py_DECREF(name);
     }
 }
 
 static PyObject *
 _PySingleton_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
 )
 {
     Py_ssize_t poff = *off; // keep the original offset in case of error
     PyObject *result = NULL;
 
     if (
-        !(result = __unpack_registered(module, msg, off, size)) &&
+        !(result = __unpack_registered(context, msg, off, size)) &&
         !PyErr_Occurred()
     ) {
-        __unpack_singleton_error(module, msg, &poff);
+        __unpack_singleton_error(context, msg, &poff);
     }
     return result;
 }
@@ -594,28 +1192,289 @@ _PySingleton_Unpack(
 
 /* MSGPACK_EXT_PYOBJECT ----------------------------------------------------- */
 
+/* the reduce tuple is unpacked in place so that the object can be memoized
+   as soon as it is created (before its state is unpacked) */
+static PyObject *
+_PyObject_Unpack_(unpack_context *context, Py_buffer *msg, Py_ssize_t *off)
+{
+    PyObject *items[6] = { NULL }, *result = NULL;
+    Py_ssize_t len = -1, index = -1, i;
+
+    if ((len = __unpack_len__(msg, off)) < 0) {
+        return NULL;
+    }
+    if ((len < 2) || (len > 6)) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "tuple returned by __reduce__() must contain 2 through 6 "
+            "elements, not %zd",
+            len
+        );
+        return NULL;
+    }
+    if (
+        !__memo_reserve(context, &index) &&
+        !Py_EnterRecursiveCall(_Unpacking_("object"))
+    ) {
+        if (
+            !__unpack_sequence(context, msg, off, 2, items) &&
+            (result = __PyObject_New(items[0], items[1])) &&
+            (
+                __memo_set(context, index, result) ||
+                __unpack_sequence(context, msg, off, (len - 2), (items + 2)) ||
+                __PyObject_Build(context->state, result, items)
+            )
+        ) {
+            Py_CLEAR(result);
+        }
+        Py_LeaveRecursiveCall();
+    }
+    for (i = 0; i < len; ++i) {
+        Py_XDECREF(items[i]);
+    }
+    return result;
+}
+
+
+/* MSGPACK_EXT_PYINSTANCE --------------------------------------------------- */
+
 static PyObject *
-_PyObject_Unpack_(PyObject *module, Py_buffer *msg, Py_ssize_t *off)
+_PyInstance_Unpack_(unpack_context *context, Py_buffer *msg, Py_ssize_t *off)
 {
-    PyObject *result = NULL, *reduce = NULL;
+    PyObject *cls = NULL, *dict = NULL, *slots = NULL, *result = NULL;
+    Py_ssize_t index = -1;
 
-    if ((reduce = UnpackMessage(module, msg, off))) {
-        result = __PyObject_New(reduce);
-        Py_DECREF(reduce);
+    if (
+        !__memo_reserve(context, &index) &&
+        (cls = UnpackMessage(context, msg, off)) &&
+        (result = __PyObject_NewInstance(cls)) &&
+        (
+            __memo_set(context, index, result) ||
+            !(dict = __unpack_map(context, msg, off)) ||
+            !(slots = __unpack_map(context, msg, off)) ||
+            __PyObject_InitInstance(result, dict, slots)
+        )
+    ) {
+        Py_CLEAR(result);
+    }
+    Py_XDECREF(slots);
+    Py_XDECREF(dict);
+    Py_XDECREF(cls);
+    return result;
+}
+
+
+/* MSGPACK_EXT_PYRECORD ----------------------------------------------------- */
+
+static PyObject *
+__unpack_record(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Record *record
+)
+{
+    PyObject *result = NULL, *item = NULL;
+    Py_ssize_t len = -1, i;
+
+    if ((len = __unpack_len__(msg, off)) < 0) {
+        return NULL;
+    }
+    if (len != PyTuple_GET_SIZE(record->fields)) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "'%.200s' record expects %zd fields, got %zd",
+            record->cls->tp_name, PyTuple_GET_SIZE(record->fields), len
+        );
+        return NULL;
+    }
+    if (!Py_EnterRecursiveCall(_Unpacking_("record"))) {
+        if (
+            (result = RecordNewInstance(record)) &&
+            __memo_add(context, result)
+        ) {
+            Py_CLEAR(result);
+        }
+        if (result) {
+            for (i = 0; i < len; ++i) {
+                if (
+                    !(item = UnpackMessage(context, msg, off)) ||
+                    RecordSetField(record, result, i, item)
+                ) {
+                    Py_XDECREF(item);
+                    Py_CLEAR(result);
+                    break;
+                }
+                Py_DECREF(item);
+            }
+        }
+        Py_LeaveRecursiveCall();
     }
     return result;
 }
 
+static PyObject *
+_PyRecord_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    const char *buffer = NULL;
+    PyObject *record = NULL, *result = NULL;
+
+    if (size < MSGPACK_RECORD_TAG) {
+        return _PyErr_InvalidSize_("record", size);
+    }
+    if (!(buffer = __unpack_buffer(msg, off, MSGPACK_RECORD_TAG))) {
+        return NULL;
+    }
+    if (
+        !(
+            record = RegistryGet(
+                &context->state->record_tags, buffer, MSGPACK_RECORD_TAG
+            )
+        ) // borrowed
+    ) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "cannot unpack record 0x%08x (class not compiled)",
+            __unpack_uint4(buffer)
+        );
+        return NULL;
+    }
+    // compiling while unpacking the fields could release it
+    Py_INCREF(record);
+    result = __unpack_record(context, msg, off, (Record *)record);
+    Py_DECREF(record);
+    return result;
+}
+
+
+/* MSGPACK_EXT_PYMEMO, MSGPACK_EXT_PYSTRINGS -------------------------------- */
+
+static PyObject *
+__unpack_selection(
+    unpack_context *context,
+    Py_buffer *msg,
+    Py_ssize_t *off,
+    PyObject *selection
+);
+
+
+/* the wrapped message is unpacked (or projected if selection is not NULL)
+   with table set up */
+static PyObject *
+__unpack_indexed(
+    unpack_context *context,
+    Py_buffer *msg,
+    Py_ssize_t *off,
+    unpack_memo **table,
+    const char *name,
+    PyObject *selection
+)
+{
+    unpack_memo memo = { .len = 0, .alloc = 0, .items = NULL };
+    PyObject *result = NULL;
+    Py_ssize_t i;
+
+    if (*table) {
+        PyErr_Format(PyExc_ValueError, "nested %s message", name);
+        return NULL;
+    }
+    *table = &memo;
+    result = (selection) ?
+        __unpack_selection(context, msg, off, selection) :
+        UnpackMessage(context, msg, off);
+    *table = NULL;
+    for (i = 0; i < memo.len; ++i) {
+        Py_XDECREF(memo.items[i]);
+    }
+    PyMem_Free(memo.items);
+    return result;
+}
+
+#define _PyMemo_Unpack(_ctx_, m, o) \
+    __unpack_indexed(_ctx_, m, o, &(_ctx_)->memo, "memoized", NULL)
+
+#define _PyStrings_Unpack(_ctx_, m, o) \
+    __unpack_indexed(_ctx_, m, o, &(_ctx_)->strings, "deduplicated", NULL)
+
+
+/* MSGPACK_EXT_PYREF, MSGPACK_EXT_PYSTRREF ---------------------------------- */
+
+static PyObject *
+__unpack_reference(
+    unpack_memo *table,
+    Py_buffer *msg,
+    Py_ssize_t *off,
+    Py_ssize_t size,
+    const char *name
+)
+{
+    const char *buffer = NULL;
+    Py_ssize_t index = -1;
+    PyObject *result = NULL;
+
+    switch (size) {
+        case 1:
+            index = __unpack_size__(msg, off, 1);
+            break;
+        case 2:
+            index = __unpack_size__(msg, off, 2);
+            break;
+        case 4:
+            index = __unpack_size__(msg, off, 4);
+            break;
+        default:
+            return _PyErr_InvalidSize_("reference", size);
+    }
+    if (index < 0) {
+        return NULL;
+    }
+    if (!table) {
+        PyErr_Format(
+            PyExc_ValueError, "reference outside of a %s message", name
+        );
+    }
+    else if ((index >= table->len) || !(result = table->items[index])) {
+        PyErr_Format(PyExc_ValueError, "invalid reference: %zd", index);
+    }
+    return Py_XNewRef(result);
+}
+
+#define _PyRef_Unpack(_ctx_, m, o, s) \
+    __unpack_reference((_ctx_)->memo, m, o, s, "memoized")
+
+#define _PyStrRef_Unpack(_ctx_, m, o, s) \
+    __unpack_reference((_ctx_)->strings, m, o, s, "deduplicated")
+
+
+/* MSGPACK_EXT_PYDICTREF ---------------------------------------------------- */
+
+static PyObject *
+_PyDictRef_Unpack(
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+)
+{
+    Dictionary *dictionary = (Dictionary *)context->dictionary;
+    unpack_memo table;
+
+    if (!dictionary) {
+        PyErr_SetString(
+            PyExc_ValueError, "dictionary reference without a dictionary"
+        );
+        return NULL;
+    }
+    table.len = table.alloc = PyTuple_GET_SIZE(dictionary->items);
+    table.items = &PyTuple_GET_ITEM(dictionary->items, 0);
+    return __unpack_reference(&table, msg, off, size, "dictionary");
+}
+
 
 /* MSGPACK_EXT, MSGPACK_FIXEXT ---------------------------------------------- */
 
 static PyObject *
 _Extension_Unpack(
-    PyObject *module, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
+    unpack_context *context, Py_buffer *msg, Py_ssize_t *off, Py_ssize_t size
 )
 {
     uint8_t type = MSGPACK_INVALID;
-    const char *buffer = NULL;
     Py_ssize_t len = -1;
     PyObject *result = NULL;
 
@@ -625,31 +1484,61 @@ _Extension_Unpack(
             _PyErr_InvalidType_("extension", type);
             break;
         case MSGPACK_EXT_TIMESTAMP:
-            result = _Timestamp_Unpack(module, msg, off, size);
+            result = _Timestamp_Unpack(context, msg, off, size);
             break;
         case MSGPACK_EXT_PYCOMPLEX:
             result = _PyComplex_Unpack(msg, off, size);
             break;
         case MSGPACK_EXT_PYBYTEARRAY:
-            result = _PyByteArray_Unpack(msg, off, size);
+            result = _PyByteArray_Unpack(context, msg, off, size);
+            break;
+        case MSGPACK_EXT_PYARRAY:
+            result = _PyArray_Unpack(context, msg, off, size);
+            break;
+        case MSGPACK_EXT_PYMEMORYVIEW:
+            result = _PyMemoryView_Unpack(context, msg, off, size);
             break;
         case MSGPACK_EXT_PYLIST:
-            result = _PyList_Unpack_(module, msg, off);
+            result = _PyList_Unpack_(context, msg, off);
             break;
         case MSGPACK_EXT_PYSET:
-            result = _PySet_Unpack_(module, msg, off);
+            result = _PySet_Unpack_(context, msg, off);
             break;
         case MSGPACK_EXT_PYFROZENSET:
-            result = _PyFrozenSet_Unpack_(module, msg, off);
+            result = _PyFrozenSet_Unpack_(context, msg, off);
             break;
         case MSGPACK_EXT_PYCLASS:
-            result = _PyClass_Unpack(module, msg, off, size);
+            result = _PyClass_Unpack(context, msg, off, size);
+            break;
+        case MSGPACK_EXT_PYCLASSID:
+            result = _PyClassId_Unpack(context, msg, off, size);
+            break;
+        case MSGPACK_EXT_PYDICTREF:
+            result = _PyDictRef_Unpack(context, msg, off, size);
             break;
         case MSGPACK_EXT_PYSINGLETON:
-            result = _PySingleton_Unpack(module, msg, off, size);
+            result = _PySingleton_Unpack(context, msg, off, size);
+            break;
+        case MSGPACK_EXT_PYINSTANCE:
+            result = _PyInstance_Unpack_(context, msg, off);
+            break;
+        case MSGPACK_EXT_PYRECORD:
+            result = _PyRecord_Unpack(context, msg, off, size);
             break;
         case MSGPACK_EXT_PYOBJECT:
-            result = _PyObject_Unpack_(module, msg, off);
+            result = _PyObject_Unpack_(context, msg, off);
+            break;
+        case MSGPACK_EXT_PYMEMO:
+            result = _PyMemo_Unpack(context, msg, off);
+            break;
+        case MSGPACK_EXT_PYREF:
+            result = _PyRef_Unpack(context, msg, off, size);
+            break;
+        case MSGPACK_EXT_PYSTRINGS:
+            result = _PyStrings_Unpack(context, msg, off);
+            break;
+        case MSGPACK_EXT_PYSTRREF:
+            result = _PyStrRef_Unpack(context, msg, off, size);
             break;
         default:
             _PyErr_UnknownType_("extension", type);
@@ -658,8 +1547,466 @@ _Extension_Unpack(
     return result;
 }
 
-#define _Extension_Unpack_(_mod_, m, o, s) \
-    __unpack_size_mod(Extension, _mod_, m, o, s)
+#define _Extension_Unpack_(_ctx_, m, o, s) \
+    __unpack_size_ctx(Extension, _ctx_, m, o, s)
+
+
+/* --------------------------------------------------------------------------
+   selection
+   -------------------------------------------------------------------------- */
+
+/* A selection is a tree of dicts mapping the selected keys of a map to the
+   selection of their value (None for the whole value). Only maps are
+   projected, the values of the keys that are not selected are skipped using
+   only their headers (see SkipMessage()). Memoized and deduplicated messages
+   are projected through their wrappers, the values that are not selected are
+   then unpacked (and dropped) to keep the references that follow them
+   valid. */
+
+static int
+__selection_add(PyObject *selection, PyObject *path)
+{
+    PyObject *node = selection, *sub = NULL;
+    Py_ssize_t len = 0, i;
+
+    if (!PyTuple_CheckExact(path)) {
+        return PyDict_SetItem(selection, path, Py_None);
+    }
+    if (!(len = PyTuple_GET_SIZE(path))) {
+        PyErr_SetString(PyExc_ValueError, "empty selection path");
+        return -1;
+    }
+    for (i = 0; i < (len - 1); ++i) {
+        if (!(sub = PyDict_GetItemWithError(node, PyTuple_GET_ITEM(path, i)))) {
+            if (
+                PyErr_Occurred() ||
+                !(sub = PyDict_New()) ||
+                PyDict_SetItem(node, PyTuple_GET_ITEM(path, i), sub)
+            ) {
+                Py_XDECREF(sub);
+                return -1;
+            }
+            Py_DECREF(sub); // borrowed from node
+        }
+        else if (sub == Py_None) { // the whole value is already selected
+            return 0;
+        }
+        node = sub;
+    }
+    return PyDict_SetItem(node, PyTuple_GET_ITEM(path, i), Py_None);
+}
+
+
+/* the value following a key that is not selected */
+static int
+__selection_skip(unpack_context *context, Py_buffer *msg, Py_ssize_t *off)
+{
+    PyObject *obj = NULL;
+    Py_ssize_t size = 0;
+
+    if (
+        !context->memo &&
+        !context->strings &&
+        SkipMessage(
+            (msg->buf + *off), (msg->len - *off), MSGPACK_SKIP_DEPTH_MAX, &size
+        )
+    ) {
+        *off += size;
+        return 0;
+    }
+    // let unpacking report the error (or deal with a deeper value)
+    if (!(obj = UnpackMessage(context, msg, off))) {
+        return -1;
+    }
+    Py_DECREF(obj);
+    return 0;
+}
+
+
+static PyObject *
+__unpack_selection(
+    unpack_context *context,
+    Py_buffer *msg,
+    Py_ssize_t *off,
+    PyObject *selection
+)
+{
+    PyObject *result = NULL, *key = NULL, *sub = NULL, *val = NULL;
+    Py_ssize_t size = 0, items = 0, i;
+    uint8_t type = MSGPACK_INVALID;
+    int res = 0;
+
+    if (
+        (
+            size = ScanExtension(
+                (msg->buf + *off), (msg->len - *off), MSGPACK_EXT_PYSTRINGS
+            )
+        )
+    ) {
+        *off += size;
+        return __unpack_indexed(
+            context, msg, off, &context->strings, "deduplicated", selection
+        );
+    }
+    if (
+        (
+            size = ScanExtension(
+                (msg->buf + *off), (msg->len - *off), MSGPACK_EXT_PYMEMO
+            )
+        )
+    ) {
+        *off += size;
+        return __unpack_indexed(
+            context, msg, off, &context->memo, "memoized", selection
+        );
+    }
+    if (
+        (*off >= msg->len) ||
+        !(
+            ((MSGPACK_FIXMAP <= (type = ((uint8_t *)msg->buf)[*off])) &&
+            (type <= MSGPACK_FIXMAP_END)) ||
+            (type == MSGPACK_MAP2) ||
+            (type == MSGPACK_MAP4)
+        ) ||
+        (
+            (
+                size = ScanHeader(
+                    (msg->buf + *off), (msg->len - *off), &items
+                )
+            ) < 0
+        ) ||
+        (size > (msg->len - *off))
+    ) {
+        PyErr_Clear();
+        return UnpackMessage(context, msg, off);
+    }
+    *off += size;
+    if (Py_EnterRecursiveCall(_Unpacking_("dict"))) {
+        return NULL;
+    }
+    if ((result = PyDict_New()) && __memo_add(context, result)) {
+        Py_CLEAR(result);
+    }
+    if (result) {
+        for (i = 0; i < items; i += 2) {
+            if (
+                !(key = __unpack_key(context, msg, off)) ||
+                (
+                    !(sub = PyDict_GetItemWithError(selection, key)) &&
+                    PyErr_Occurred()
+                )
+            ) {
+                res = -1;
+            }
+            else if (!sub) {
+                res = __selection_skip(context, msg, off);
+            }
+            else {
+                res = (
+                    (
+                        val = (sub == Py_None) ?
+                        UnpackMessage(context, msg, off) :
+                        __unpack_selection(context, msg, off, sub)
+                    ) ? PyDict_SetItem(result, key, val) : -1
+                );
+                Py_XDECREF(val);
+            }
+            Py_XDECREF(key);
+            if (res) {
+                Py_CLEAR(result);
+                break;
+            }
+        }
+    }
+    Py_LeaveRecursiveCall();
+    return result;
+}
+
+
+/* --------------------------------------------------------------------------
+   scan
+   -------------------------------------------------------------------------- */
+
+/* Returns the size of the object starting at buffer (only the header for
+   arrays and maps, their items are scanned as separate objects) or, if len is
+   too small to read the header, the size of the header. *items is set to the
+   number of objects following the header. */
+static Py_ssize_t
+__scan_header(const char *buffer, Py_ssize_t len, Py_ssize_t *items)
+{
+    uint8_t type = MSGPACK_INVALID;
+    Py_ssize_t size = -1;
+
+    *items = 0;
+    if (len < 1) {
+        return 1;
+    }
+    if ((type = *((uint8_t *)buffer)) == MSGPACK_INVALID) {
+        __PyErr_InvalidType__(NULL, type);
+    }
+    else if (
+        ((MSGPACK_FIXINT <= type) && (type <= MSGPACK_FIXINT_END)) ||
+        ((MSGPACK_FIXUINT <= type) && (type <= MSGPACK_FIXUINT_END))
+    ) {
+        size = 1;
+    }
+    else if ((MSGPACK_FIXMAP <= type) && (type <= MSGPACK_FIXMAP_END)) {
+        *items = (type & MSGPACK_FIXOBJ_BIT) << 1;
+        size = 1;
+    }
+    else if ((MSGPACK_FIXARRAY <= type) && (type <= MSGPACK_FIXARRAY_END)) {
+        *items = (type & MSGPACK_FIXOBJ_BIT);
+        size = 1;
+    }
+    else if ((MSGPACK_FIXSTR <= type) && (type <= MSGPACK_FIXSTR_END)) {
+        size = 1 + (type & MSGPACK_FIXSTR_BIT);
+    }
+    else {
+        switch (type) {
+            case MSGPACK_NIL:
+            case MSGPACK_FALSE:
+            case MSGPACK_TRUE:
+                size = 1;
+                break;
+            case MSGPACK_UINT1:
+            case MSGPACK_INT1:
+                size = 2;
+                break;
+            case MSGPACK_UINT2:
+            case MSGPACK_INT2:
+                size = 3;
+                break;
+            case MSGPACK_FIXEXT1:
+                size = 3;
+                break;
+            case MSGPACK_FIXEXT2:
+                size = 4;
+                break;
+            case MSGPACK_FLOAT4:
+            case MSGPACK_UINT4:
+            case MSGPACK_INT4:
+                size = 5;
+                break;
+            case MSGPACK_FIXEXT4:
+                size = 6;
+                break;
+            case MSGPACK_FLOAT8:
+            case MSGPACK_UINT8:
+            case MSGPACK_INT8:
+                size = 9;
+                break;
+            case MSGPACK_FIXEXT8:
+                size = 10;
+                break;
+            case MSGPACK_FIXEXT16:
+                size = 18;
+                break;
+            case MSGPACK_BIN1:
+            case MSGPACK_STR1:
+                size = (len < 2) ? 2 : 2 + __unpack_uint1((buffer + 1));
+                break;
+            case MSGPACK_BIN2:
+            case MSGPACK_STR2:
+                size = (len < 3) ? 3 : 3 + __unpack_uint2((buffer + 1));
+                break;
+            case MSGPACK_BIN4:
+            case MSGPACK_STR4:
+                size = (len < 5) ? 5 : 5 + (Py_ssize_t)__unpack_uint4((buffer + 1));
+                break;
+            case MSGPACK_EXT1:
+                size = (len < 2) ? 3 : 3 + __unpack_uint1((buffer + 1));
+                break;
+            case MSGPACK_EXT2:
+                size = (len < 3) ? 4 : 4 + __unpack_uint2((buffer + 1));
+                break;
+            case MSGPACK_EXT4:
+                size = (len < 5) ? 6 : 6 + (Py_ssize_t)__unpack_uint4((buffer + 1));
+                break;
+            case MSGPACK_ARRAY2:
+                if ((size = 3) <= len) {
+                    *items = __unpack_uint2((buffer + 1));
+                }
+                break;
+            case MSGPACK_ARRAY4:
+                if ((size = 5) <= len) {
+                    *items = (Py_ssize_t)__unpack_uint4((buffer + 1));
+                }
+                break;
+            case MSGPACK_MAP2:
+                if ((size = 3) <= len) {
+                    *items = (Py_ssize_t)__unpack_uint2((buffer + 1)) << 1;
+                }
+                break;
+            case MSGPACK_MAP4:
+                if ((size = 5) <= len) {
+                    *items = (Py_ssize_t)__unpack_uint4((buffer + 1)) << 1;
+                }
+                break;
+            default:
+                __PyErr_UnknownType__(NULL, type);
+                break;
+        }
+    }
+    return size;
+}
+
+
+/* Returns the size of the header of the extension starting at buffer, 0 if
+   buffer doesn't start with an extension. */
+static inline Py_ssize_t
+__scan_ext_header(const char *buffer)
+{
+    switch (*((uint8_t *)buffer)) {
+        case MSGPACK_FIXEXT1:
+        case MSGPACK_FIXEXT2:
+        case MSGPACK_FIXEXT4:
+        case MSGPACK_FIXEXT8:
+        case MSGPACK_FIXEXT16:
+            return 2;
+        case MSGPACK_EXT1:
+            return 3;
+        case MSGPACK_EXT2:
+            return 4;
+        case MSGPACK_EXT4:
+            return 6;
+        default:
+            return 0;
+    }
+}
+
+
+/* The payload of these extensions is itself made of packed objects, returns
+   the offset of the first of them in the extension starting at buffer (0 if
+   buffer doesn't start with one of these extensions). *items is set to the
+   number of packed objects in the payload. */
+static inline Py_ssize_t
+__scan_ext_payload(const char *buffer, Py_ssize_t *items)
+{
+    Py_ssize_t size = 0;
+
+    if (!(size = __scan_ext_header(buffer))) {
+        return 0;
+    }
+    *items = 1;
+    switch (((uint8_t *)buffer)[(size - 1)]) {
+        case MSGPACK_EXT_PYLIST:
+        case MSGPACK_EXT_PYSET:
+        case MSGPACK_EXT_PYFROZENSET:
+        case MSGPACK_EXT_PYMEMO:
+        case MSGPACK_EXT_PYSTRINGS:
+        case MSGPACK_EXT_PYOBJECT:
+            return size;
+        case MSGPACK_EXT_PYINSTANCE: // class, dict, slots
+            *items = 3;
+            return size;
+        case MSGPACK_EXT_PYRECORD:
+            return size + MSGPACK_RECORD_TAG;
+        default:
+            *items = 0;
+            return 0;
+    }
+}
+
+
+static inline int
+__scan_push(scan_state *state, Py_ssize_t items)
+{
+    Py_ssize_t alloc = 0;
+    Py_ssize_t *pending = NULL;
+
+    if (state->depth == state->alloc) {
+        alloc = (state->alloc) ? (state->alloc << 1) : 8;
+        if (!(pending = PyMem_Resize(state->pending, Py_ssize_t, alloc))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        state->pending = pending;
+        state->alloc = alloc;
+    }
+    state->pending[state->depth++] = items;
+    return 0;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+void
+ResetScanState(scan_state *state)
+{
+    state->off = 0;
+    state->depth = 0;
+}
+
+
+void
+ClearScanState(scan_state *state)
+{
+    PyMem_Free(state->pending);
+    state->pending = NULL;
+    state->alloc = 0;
+    ResetScanState(state);
+}
+
+
+int
+ScanMessage(scan_state *state, const char *buffer, Py_ssize_t len)
+{
+    Py_ssize_t size = -1, items = 0;
+
+    do {
+        if (
+            (
+                size = __scan_header(
+                    (buffer + state->off), (len - state->off), &items
+                )
+            ) < 0
+        ) {
+            return -1;
+        }
+        if (size > (len - state->off)) {
+            return 0;
+        }
+        state->off += size;
+        if (items) {
+            if (__scan_push(state, items)) {
+                return -1;
+            }
+        }
+        else {
+            while (state->depth && !(--state->pending[(state->depth - 1)])) {
+                state->depth--;
+            }
+        }
+    } while (state->depth);
+    return 1;
+}
+
+
+Py_ssize_t
+ScanHeader(const char *buffer, Py_ssize_t len, Py_ssize_t *items)
+{
+    return __scan_header(buffer, len, items);
+}
+
+
+/* Returns the size of the header of the extension of type type starting at
+   buffer, 0 if buffer doesn't start with such an extension (or if len is too
+   small to hold anything after its header). */
+Py_ssize_t
+ScanExtension(const char *buffer, Py_ssize_t len, uint8_t type)
+{
+    Py_ssize_t size = 0;
+
+    if (
+        (len < 1) ||
+        !(size = __scan_ext_header(buffer)) ||
+        (size >= len) ||
+        (((uint8_t *)buffer)[(size - 1)] != type)
+    ) {
+        return 0;
+    }
+    return size;
+}
 
 
 /* --------------------------------------------------------------------------
@@ -667,7 +2014,147 @@ _Extension_Unpack(
    -------------------------------------------------------------------------- */
 
 PyObject *
-UnpackMessage(PyObject *module, Py_buffer *msg, Py_ssize_t *off)
+NewSelection(PyObject *paths)
+{
+    PyObject *selection = NULL, *iter = NULL, *path = NULL;
+
+    if ((iter = PyObject_GetIter(paths)) && (selection = PyDict_New())) {
+        while ((path = PyIter_Next(iter))) {
+            if (__selection_add(selection, path)) {
+                Py_DECREF(path);
+                break;
+            }
+            Py_DECREF(path);
+        }
+        if (PyErr_Occurred()) {
+            Py_CLEAR(selection);
+        }
+    }
+    Py_XDECREF(iter);
+    return selection;
+}
+
+
+PyObject *
+UnpackSelection(
+    unpack_context *context,
+    Py_buffer *msg,
+    Py_ssize_t *off,
+    PyObject *selection
+)
+{
+    return __unpack_selection(context, msg, off, selection);
+}
+
+
+/* Like ScanMessage() but for a complete message, the number of objects left
+   in each unfinished array/map is kept on the stack (hence the depth limit).
+   The payloads of the extensions wrapping packed objects (lists, sets,
+   instances...) are scanned the same way, along with the end of the
+   enclosing payload, and must end exactly where their header says (only
+   arrays/maps count against max_depth).
+   Returns 1 if the object at the start of buffer is valid (and *off is set to
+   its size), 0 otherwise (and *off is set to the offset of the invalid,
+   truncated or too deeply nested object). Never sets an exception. */
+int
+SkipMessage(
+    const char *buffer, Py_ssize_t len, Py_ssize_t max_depth, Py_ssize_t *off
+)
+{
+    Py_ssize_t pending[(MSGPACK_SKIP_DEPTH_MAX << 1)];
+    Py_ssize_t ends[(MSGPACK_SKIP_DEPTH_MAX << 1)]; // -1 for arrays/maps
+    Py_ssize_t depth = 0, nested = 0, size = -1, items = 0, pos = 0;
+    Py_ssize_t ext = 0, end = len; // end of the innermost payload
+
+    max_depth = Py_MIN(max_depth, MSGPACK_SKIP_DEPTH_MAX);
+    do {
+        if (
+            (pos >= end) ||
+            (*((uint8_t *)(buffer + pos)) == MSGPACK_INVALID) ||
+            ((size = __scan_header((buffer + pos), (end - pos), &items)) < 0) ||
+            (size > (end - pos)) ||
+            (items && (nested >= max_depth)) ||
+            (
+                (ext = __scan_ext_payload((buffer + pos), &items)) &&
+                (ext >= size)
+            ) ||
+            (items && (depth >= (MSGPACK_SKIP_DEPTH_MAX << 1)))
+        ) {
+            if (size < 0) {
+                PyErr_Clear();
+            }
+            *off = pos;
+            return 0;
+        }
+        if (items) {
+            pending[depth] = items;
+            if (ext) {
+                ends[depth++] = end;
+                end = pos + size;
+                pos += ext;
+            }
+            else {
+                ends[depth++] = -1;
+                nested++;
+                pos += size;
+            }
+            continue;
+        }
+        pos += size;
+        while (depth && !(--pending[(depth - 1)])) {
+            if (ends[--depth] < 0) {
+                nested--;
+            }
+            else if (pos == end) {
+                end = ends[depth];
+            }
+            else {
+                *off = pos;
+                return 0;
+            }
+        }
+    } while (depth);
+    *off = pos;
+    return 1;
+}
+
+
+void
+ClearKeyCache(PyObject **cache)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < MSGPACK_KEY_CACHE_SIZE; ++i) {
+        Py_CLEAR(cache[i]);
+    }
+}
+
+
+int
+InitUnpackContext(unpack_context *context, PyObject *module, int flags)
+{
+    context->view = NULL;
+    context->memo = NULL;
+    context->strings = NULL;
+    context->dictionary = NULL;
+    if (!(context->state = __PyModule_GetState__(module))) {
+        return -1;
+    }
+    context->module = module;
+    context->flags = flags;
+    return 0;
+}
+
+
+void
+ClearUnpackContext(unpack_context *context)
+{
+    Py_CLEAR(context->view);
+}
+
+
+PyObject *
+UnpackMessage(unpack_context *context, Py_buffer *msg, Py_ssize_t *off)
 {
     uint8_t type = MSGPACK_INVALID;
     const char *buffer = NULL;
@@ -684,13 +2171,15 @@ UnpackMessage(PyObject *module, Py_buffer *msg, Py_ssize_t *off)
         result = PyLong_FromUnsignedLong(type);
     }
     else if ((MSGPACK_FIXMAP <= type) && (type <= MSGPACK_FIXMAP_END)) {
-        result = _PyDict_Unpack(module, msg, off, (type & MSGPACK_FIXOBJ_BIT));
+        result = _PyDict_Unpack(context, msg, off, (type & MSGPACK_FIXOBJ_BIT));
     }
     else if ((MSGPACK_FIXARRAY <= type) && (type <= MSGPACK_FIXARRAY_END)) {
-        result = _PyTuple_Unpack(module, msg, off, (type & MSGPACK_FIXOBJ_BIT));
+        result = _PyTuple_Unpack(context, msg, off, (type & MSGPACK_FIXOBJ_BIT));
     }
     else if ((MSGPACK_FIXSTR <= type) && (type <= MSGPACK_FIXSTR_END)) {
-        result = _PyUnicode_Unpack(msg, off, (type & MSGPACK_FIXSTR_BIT));
+        result = __unpack_string(
+            context, _PyUnicode_Unpack(msg, off, (type & MSGPACK_FIXSTR_BIT))
+        );
     }
     else {
         switch (type) {
@@ -704,22 +2193,22 @@ UnpackMessage(PyObject *module, Py_buffer *msg, Py_ssize_t *off)
                 result = Py_NewRef(Py_True);
                 break;
             case MSGPACK_BIN1:
-                result = _PyBytes_Unpack_(msg, off, 1);
+                result = _PyBytes_Unpack_(context, msg, off, 1);
                 break;
             case MSGPACK_BIN2:
-                result = _PyBytes_Unpack_(msg, off, 2);
+                result = _PyBytes_Unpack_(context, msg, off, 2);
                 break;
             case MSGPACK_BIN4:
-                result = _PyBytes_Unpack_(msg, off, 4);
+                result = _PyBytes_Unpack_(context, msg, off, 4);
                 break;
             case MSGPACK_EXT1:
-                result = _Extension_Unpack_(module, msg, off, 1);
+                result = _Extension_Unpack_(context, msg, off, 1);
                 break;
             case MSGPACK_EXT2:
-                result = _Extension_Unpack_(module, msg, off, 2);
+                result = _Extension_Unpack_(context, msg, off, 2);
                 break;
             case MSGPACK_EXT4:
-                result = _Extension_Unpack_(module, msg, off, 4);
+                result = _Extension_Unpack_(context, msg, off, 4);
                 break;
             case MSGPACK_FLOAT4:
                 result = _PyFloat_Unpack(msg, off, 4);
@@ -752,40 +2241,46 @@ UnpackMessage(PyObject *module, Py_buffer *msg, Py_ssize_t *off)
                 result = _PyLong_Unpack(msg, off, 8);
                 break;
             case MSGPACK_FIXEXT1:
-                result = _Extension_Unpack(module, msg, off, 1);
+                result = _Extension_Unpack(context, msg, off, 1);
                 break;
             case MSGPACK_FIXEXT2:
-                result = _Extension_Unpack(module, msg, off, 2);
+                result = _Extension_Unpack(context, msg, off, 2);
                 break;
             case MSGPACK_FIXEXT4:
-                result = _Extension_Unpack(module, msg, off, 4);
+                result = _Extension_Unpack(context, msg, off, 4);
                 break;
             case MSGPACK_FIXEXT8:
-                result = _Extension_Unpack(module, msg, off, 8);
+                result = _Extension_Unpack(context, msg, off, 8);
                 break;
             case MSGPACK_FIXEXT16:
-                result = _Extension_Unpack(module, msg, off, 16);
+                result = _Extension_Unpack(context, msg, off, 16);
                 break;
             case MSGPACK_STR1:
-                result = _PyUnicode_Unpack_(msg, off, 1);
+                result = __unpack_string(
+                    context, _PyUnicode_Unpack_(msg, off, 1)
+                );
                 break;
             case MSGPACK_STR2:
-                result = _PyUnicode_Unpack_(msg, off, 2);
+                result = __unpack_string(
+                    context, _PyUnicode_Unpack_(msg, off, 2)
+                );
                 break;
             case MSGPACK_STR4:
-                result = _PyUnicode_Unpack_(msg, off, 4);
+                result = __unpack_string(
+                    context, _PyUnicode_Unpack_(msg, off, 4)
+                );
                 break;
             case MSGPACK_ARRAY2:
-                result = _PyTuple_Unpack_(module, msg, off, 2);
+                result = _PyTuple_Unpack_(context, msg, off, 2);
                 break;
             case MSGPACK_ARRAY4:
-                result = _PyTuple_Unpack_(module, msg, off, 4);
+                result = _PyTuple_Unpack_(context, msg, off, 4);
                 break;
             case MSGPACK_MAP2:
-                result = _PyDict_Unpack_(module, msg, off, 2);
+                result = _PyDict_Unpack_(context, msg, off, 2);
                 break;
             case MSGPACK_MAP4:
-                result = _PyDict_Unpack_(module, msg, off, 4);
+                result = _PyDict_Unpack_(context, msg, off, 4);
                 break;
             default:
                 _PyErr_UnknownType_(NULL, type);
@@ -0,0 +1,348 @@
+#include "msgpack.h"
+
+
+/* --------------------------------------------------------------------------
+   Unpacker
+   -------------------------------------------------------------------------- */
+
+static PyObject *
+_Unpacker_New(PyTypeObject *type, int flags, PyObject *arg)
+{
+    Unpacker *self = NULL;
+    PyObject *module = NULL, *dictionary = NULL;
+    module_state *state = NULL;
+
+    if (
+        !(module = PyType_GetModule(type)) ||
+        !(state = __PyModule_GetState__(module)) ||
+        (!(dictionary = DictionaryArg(state, arg)) && PyErr_Occurred())
+    ) {
+        return NULL;
+    }
+    if ((self = PyObject_GC_NEW(Unpacker, type))) {
+        self->module = Py_NewRef(module);
+        self->buffer = NULL;
+        self->start = self->len = self->alloc = 0;
+        self->scan.pending = NULL;
+        self->scan.alloc = 0;
+        ResetScanState(&self->scan);
+        self->flags = flags;
+        self->unpacking = 0;
+        self->dictionary = Py_XNewRef(dictionary);
+        PyObject_GC_Track(self);
+    }
+    return _PyObject_CAST(self);
+}
+
+
+/* the (incomplete) data left at the end of the buffer is only moved to its
+   start when appending would otherwise require a reallocation */
+static int
+_Unpacker_Feed(Unpacker *self, const char *data, Py_ssize_t size)
+{
+    Py_ssize_t len = self->len - self->start, alloc = 0;
+    char *buffer = NULL;
+
+    if ((self->len + size) > self->alloc) {
+        if (self->start) {
+            memmove(self->buffer, (self->buffer + self->start), len);
+            self->start = 0;
+            self->len = len;
+        }
+        if ((len + size) > self->alloc) {
+            if (size > (PY_SSIZE_T_MAX - len)) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            alloc = Py_MAX((len + size), (self->alloc << 1));
+            if (!(buffer = PyMem_Realloc(self->buffer, alloc))) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            self->buffer = buffer;
+            self->alloc = alloc;
+        }
+    }
+    memcpy((self->buffer + self->len), data, size);
+    self->len += size;
+    return 0;
+}
+
+
+/* the scan state is kept between calls so that a partially received message
+   is never scanned again from its start, the message is consumed even if
+   unpacking it fails */
+static PyObject *
+_Unpacker_Next(Unpacker *self)
+{
+    unpack_context context;
+    Py_buffer msg;
+    Py_ssize_t off = 0, size = 0;
+    PyObject *result = NULL;
+    int res = -1;
+
+    if (
+        (self->len > self->start) &&
+        (
+            (
+                res = ScanMessage(
+                    &self->scan,
+                    (self->buffer + self->start),
+                    (self->len - self->start)
+                )
+            ) > 0
+        )
+    ) {
+        size = self->scan.off;
+        if (
+            !InitUnpackContext(&context, self->module, self->flags) &&
+            !PyBuffer_FillInfo(
+                &msg, NULL, (self->buffer + self->start), size, 1, PyBUF_SIMPLE
+            )
+        ) {
+            context.dictionary = self->dictionary;
+            self->unpacking = 1;
+            result = UnpackMessage(&context, &msg, &off);
+            self->unpacking = 0;
+        }
+        ClearUnpackContext(&context);
+        ResetScanState(&self->scan);
+        if ((self->start += size) == self->len) {
+            self->start = self->len = 0;
+        }
+    }
+    return result;
+}
+
+
+/* Unpacker_Type ------------------------------------------------------------ */
+
+/* Unpacker_Type.tp_new */
+static PyObject *
+Unpacker_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"cache_keys", "dictionary", NULL};
+    PyObject *dictionary = Py_None;
+    int cache_keys = 0;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "|$pO:__new__", kwlist, &cache_keys, &dictionary
+        )
+    ) {
+        return NULL;
+    }
+    return _Unpacker_New(
+        type,
+        (cache_keys ? MSGPACK_UNPACK_CACHE_KEYS : MSGPACK_UNPACK_DEFAULT),
+        dictionary
+    );
+}
+
+
+/* Unpacker_Type.tp_traverse */
+static int
+Unpacker_tp_traverse(Unpacker *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self)); // heap type
+    Py_VISIT(self->module);
+    Py_VISIT(self->dictionary);
+    return 0;
+}
+
+
+/* Unpacker_Type.tp_clear */
+static int
+Unpacker_tp_clear(Unpacker *self)
+{
+    Py_CLEAR(self->dictionary);
+    Py_CLEAR(self->module);
+    return 0;
+}
+
+
+/* Unpacker_Type.tp_dealloc */
+static void
+Unpacker_tp_dealloc(Unpacker *self)
+{
+    PyObject_GC_UnTrack(self);
+    Unpacker_tp_clear(self);
+    ClearScanState(&self->scan);
+    PyMem_Free(self->buffer);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
+}
+
+
+/* Unpacker_Type.tp_iternext */
+static PyObject *
+Unpacker_tp_iternext(Unpacker *self)
+{
+    if (self->unpacking) {
+        PyErr_SetString(PyExc_RuntimeError, "Unpacker is already unpacking");
+        return NULL;
+    }
+    return _Unpacker_Next(self);
+}
+
+
+/* Unpacker.feed() */
+PyDoc_STRVAR(Unpacker_feed_doc,
+"feed(data)");
+
+static PyObject *
+Unpacker_feed(Unpacker *self, PyObject *args)
+{
+    Py_buffer data;
+    int res = -1;
+
+    if (self->unpacking) {
+        PyErr_SetString(PyExc_RuntimeError, "Unpacker is already unpacking");
+        return NULL;
+    }
+    if (PyArg_ParseTuple(args, "y*:feed", &data)) {
+        res = _Unpacker_Feed(self, data.buf, data.len);
+        PyBuffer_Release(&data);
+    }
+    if (res) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* Unpacker_Type.tp_methods */
+static PyMethodDef Unpacker_tp_methods[] = {
+    {
+        "feed", (PyCFunction)Unpacker_feed,
+        METH_VARARGS, Unpacker_feed_doc
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot Unpacker_Slots[] = {
+    {Py_tp_doc, "Unpacker(*, cache_keys=False, dictionary=None)"},
+    {Py_tp_new, Unpacker_tp_new},
+    {Py_tp_traverse, Unpacker_tp_traverse},
+    {Py_tp_clear, Unpacker_tp_clear},
+    {Py_tp_dealloc, Unpacker_tp_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, Unpacker_tp_iternext},
+    {Py_tp_methods, Unpacker_tp_methods},
+    {0, NULL}
+};
+
+
+PyType_Spec Unpacker_Spec = {
+    .name = "mood.msgpack.Unpacker",
+    .basicsize = sizeof(Unpacker),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = Unpacker_Slots
+};
+
+
+/* --------------------------------------------------------------------------
+   UnpackIterator
+   -------------------------------------------------------------------------- */
+
+/* UnpackIterator_Type.tp_traverse */
+static int
+UnpackIterator_tp_traverse(UnpackIterator *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self)); // heap type
+    Py_VISIT(self->module);
+    Py_VISIT(self->msg.obj);
+    return 0;
+}
+
+
+/* UnpackIterator_Type.tp_clear */
+static int
+UnpackIterator_tp_clear(UnpackIterator *self)
+{
+    if (self->msg.obj) {
+        PyBuffer_Release(&self->msg);
+    }
+    Py_CLEAR(self->module);
+    return 0;
+}
+
+
+/* UnpackIterator_Type.tp_dealloc */
+static void
+UnpackIterator_tp_dealloc(UnpackIterator *self)
+{
+    PyObject_GC_UnTrack(self);
+    UnpackIterator_tp_clear(self);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
+}
+
+
+/* UnpackIterator_Type.tp_iternext */
+static PyObject *
+UnpackIterator_tp_iternext(UnpackIterator *self)
+{
+    unpack_context context;
+    PyObject *result = NULL;
+
+    if (self->msg.obj && (self->off < self->msg.len)) {
+        if (
+            InitUnpackContext(&context, self->module, self->flags) ||
+            !(result = UnpackMessage(&context, &self->msg, &self->off))
+        ) {
+            PyBuffer_Release(&self->msg); // stop on error
+        }
+        ClearUnpackContext(&context);
+    }
+    return result;
+}
+
+
+static PyType_Slot UnpackIterator_Slots[] = {
+    {Py_tp_traverse, UnpackIterator_tp_traverse},
+    {Py_tp_clear, UnpackIterator_tp_clear},
+    {Py_tp_dealloc, UnpackIterator_tp_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, UnpackIterator_tp_iternext},
+    {0, NULL}
+};
+
+
+PyType_Spec UnpackIterator_Spec = {
+    .name = "mood.msgpack.unpack_iterator",
+    .basicsize = sizeof(UnpackIterator),
+    .flags = (
+        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC |
+        Py_TPFLAGS_DISALLOW_INSTANTIATION
+    ),
+    .slots = UnpackIterator_Slots
+};
+
+
+/* --------------------------------------------------------------------------
+   interface
+   -------------------------------------------------------------------------- */
+
+PyObject *
+NewUnpackIterator(PyObject *type, PyObject *module, PyObject *obj, int flags)
+{
+    UnpackIterator *self = NULL;
+
+    if ((self = PyObject_GC_NEW(UnpackIterator, (PyTypeObject *)type))) {
+        self->module = Py_NewRef(module);
+        self->off = 0;
+        self->flags = flags;
+        if (PyObject_GetBuffer(obj, &self->msg, PyBUF_SIMPLE)) {
+            self->msg.obj = NULL;
+            Py_CLEAR(self);
+        }
+        else {
+            PyObject_GC_Track(self);
+        }
+    }
+    return _PyObject_CAST(self);
+}
@@ -0,0 +1,504 @@
+#include "msgpack.h"
+
+
+/* --------------------------------------------------------------------------
+   View
+   -------------------------------------------------------------------------- */
+
+/* A view covers one packed object of a message. The items of arrays and maps
+   are only located when accessed (their offsets are indexed as they are
+   walked), nested arrays and maps are returned as views, anything else is
+   unpacked. Nested views share the buffer exported by the root view. */
+
+enum {
+    VIEW_OBJECT = 0,
+    VIEW_ARRAY,
+    VIEW_MAP
+};
+
+
+static inline int
+__view_kind(uint8_t type)
+{
+    if (
+        ((MSGPACK_FIXARRAY <= type) && (type <= MSGPACK_FIXARRAY_END)) ||
+        (type == MSGPACK_ARRAY2) ||
+        (type == MSGPACK_ARRAY4)
+    ) {
+        return VIEW_ARRAY;
+    }
+    if (
+        ((MSGPACK_FIXMAP <= type) && (type <= MSGPACK_FIXMAP_END)) ||
+        (type == MSGPACK_MAP2) ||
+        (type == MSGPACK_MAP4)
+    ) {
+        return VIEW_MAP;
+    }
+    return VIEW_OBJECT;
+}
+
+
+/* lists are packed as an extension wrapping an array, returns the size of the
+   extension header (0 if buffer doesn't start with a list) */
+static inline Py_ssize_t
+__view_list(const char *buffer, Py_ssize_t len)
+{
+    return ScanExtension(buffer, len, MSGPACK_EXT_PYLIST);
+}
+
+
+/* the references in memoized and deduplicated messages can only be resolved
+   by unpacking them whole (see unpack()) */
+static inline int
+__view_indexed(const char *buffer, Py_ssize_t len)
+{
+    if (ScanExtension(buffer, len, MSGPACK_EXT_PYMEMO)) {
+        PyErr_SetString(PyExc_TypeError, "cannot view a memoized message");
+        return -1;
+    }
+    if (ScanExtension(buffer, len, MSGPACK_EXT_PYSTRINGS)) {
+        PyErr_SetString(
+            PyExc_TypeError, "cannot view a deduplicated message"
+        );
+        return -1;
+    }
+    return 0;
+}
+
+
+#define __view_eof__() PyErr_SetString(PyExc_EOFError, "Ran out of input")
+
+
+static PyObject *
+_View_New(
+    PyTypeObject *type,
+    PyObject *module,
+    PyObject *root,
+    Py_buffer *msg,
+    Py_ssize_t start,
+    PyObject *dictionary
+)
+{
+    View *self = NULL;
+    const char *buffer = (msg->buf + start);
+    Py_ssize_t len = msg->len - start, size = -1, items = 0, ext = 0;
+
+    if (len < 1) {
+        __view_eof__();
+        return NULL;
+    }
+    if (__view_indexed(buffer, len)) {
+        return NULL;
+    }
+    if ((ext = __view_list(buffer, len))) {
+        buffer += ext;
+        len -= ext;
+    }
+    if ((size = ScanHeader(buffer, len, &items)) < 0) {
+        return NULL;
+    }
+    // every item takes at least one byte
+    if ((size > len) || (items > (len - size))) {
+        __view_eof__();
+        return NULL;
+    }
+    if ((self = PyObject_GC_NEW(View, type))) {
+        self->module = Py_NewRef(module);
+        self->root = Py_XNewRef(root);
+        self->msg = *msg;
+        if (root) {
+            self->msg.obj = NULL; // owned by root
+        }
+        self->start = start;
+        self->off = start + ext + size;
+        self->kind = __view_kind(*((uint8_t *)buffer));
+        self->len = items;
+        self->index = NULL;
+        self->indexed = 0;
+        self->scan.pending = NULL;
+        self->scan.alloc = 0;
+        ResetScanState(&self->scan);
+        self->dictionary = Py_XNewRef(dictionary);
+        PyObject_GC_Track(self);
+    }
+    return _PyObject_CAST(self);
+}
+
+
+/* offset of the object following the one at off */
+static Py_ssize_t
+_View_Skip(View *self, Py_ssize_t off)
+{
+    int res = -1;
+
+    ResetScanState(&self->scan);
+    if (
+        (
+            res = ScanMessage(
+                &self->scan, (self->msg.buf + off), (self->msg.len - off)
+            )
+        ) <= 0
+    ) {
+        if (!res) {
+            __view_eof__();
+        }
+        return -1;
+    }
+    return off + self->scan.off;
+}
+
+
+/* offset of the i-th item (0 <= i < self->len) */
+static Py_ssize_t
+_View_Item(View *self, Py_ssize_t i)
+{
+    Py_ssize_t off = 0;
+
+    if (!self->index) {
+        if (!(self->index = PyMem_New(Py_ssize_t, self->len))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->index[0] = self->off;
+        self->indexed = 1;
+    }
+    while (self->indexed <= i) {
+        if ((off = _View_Skip(self, self->index[(self->indexed - 1)])) < 0) {
+            return -1;
+        }
+        self->index[self->indexed++] = off;
+    }
+    return self->index[i];
+}
+
+
+static PyObject *
+_View_Unpack(View *self, Py_ssize_t off)
+{
+    unpack_context context;
+    PyObject *result = NULL;
+
+    if (!InitUnpackContext(&context, self->module, MSGPACK_UNPACK_DEFAULT)) {
+        context.dictionary = self->dictionary;
+        result = UnpackMessage(&context, &self->msg, &off);
+    }
+    ClearUnpackContext(&context);
+    return result;
+}
+
+
+static PyObject *
+_View_Get(View *self, Py_ssize_t off)
+{
+    const char *buffer = (self->msg.buf + off);
+    Py_ssize_t len = self->msg.len - off;
+
+    if (
+        (len > 0) &&
+        (__view_kind(*((uint8_t *)buffer)) || __view_list(buffer, len))
+    ) {
+        return _View_New(
+            Py_TYPE(self),
+            self->module,
+            (self->root) ? self->root : _PyObject_CAST(self),
+            &self->msg,
+            off,
+            self->dictionary
+        );
+    }
+    return _View_Unpack(self, off);
+}
+
+
+/* str keys are compared with the packed (utf-8) representation in place,
+   returns -1 if the packed key is truncated */
+static inline int
+__view_str_equal(View *self, Py_ssize_t off, const char *key, Py_ssize_t len)
+{
+    const char *buffer = (self->msg.buf + off);
+    Py_ssize_t avail = self->msg.len - off;
+    uint8_t type = 0;
+    uint16_t len2 = 0;
+    uint32_t len4 = 0;
+    Py_ssize_t size = -1, header = 1;
+
+    if (avail < 1) {
+        return -1;
+    }
+    type = *((uint8_t *)buffer);
+    if ((MSGPACK_FIXSTR <= type) && (type <= MSGPACK_FIXSTR_END)) {
+        size = (type & MSGPACK_FIXSTR_BIT);
+    }
+    else if (type == MSGPACK_STR1) {
+        header = 2;
+    }
+    else if (type == MSGPACK_STR2) {
+        header = 3;
+    }
+    else if (type == MSGPACK_STR4) {
+        header = 5;
+    }
+    else {
+        return 0; // not a str
+    }
+    if (avail < header) {
+        return -1;
+    }
+    switch (header) {
+        case 2:
+            size = *((uint8_t *)(buffer + 1));
+            break;
+        case 3:
+            memcpy(&len2, (buffer + 1), 2);
+            size = be16toh(len2);
+            break;
+        case 5:
+            memcpy(&len4, (buffer + 1), 4);
+            size = be32toh(len4);
+            break;
+    }
+    if (size > (avail - header)) {
+        return -1;
+    }
+    return ((size == len) && !memcmp((buffer + header), key, len));
+}
+
+
+/* keys packed as a dictionary reference (see Dictionary) are unpacked to be
+   compared */
+static inline int
+__view_dictref_equal(View *self, Py_ssize_t off, PyObject *key)
+{
+    PyObject *item = NULL;
+    int res = 0;
+
+    if (
+        !ScanExtension(
+            (self->msg.buf + off), (self->msg.len - off), MSGPACK_EXT_PYDICTREF
+        )
+    ) {
+        return 0;
+    }
+    if (!(item = _View_Unpack(self, off))) {
+        return -1;
+    }
+    res = PyObject_RichCompareBool(item, key, Py_EQ);
+    Py_DECREF(item);
+    return res;
+}
+
+
+/* returns the offset of the value mapped to key, 0 if there is none */
+static Py_ssize_t
+_View_Lookup(View *self, PyObject *key)
+{
+    const char *bytes = NULL;
+    PyObject *item = NULL;
+    Py_ssize_t len = 0, off = 0, i;
+    int res = 0;
+
+    if (
+        PyUnicode_CheckExact(key) &&
+        !(bytes = PyUnicode_AsUTF8AndSize(key, &len))
+    ) {
+        return -1;
+    }
+    for (i = 0; i < self->len; i += 2) {
+        if ((off = _View_Item(self, i)) < 0) {
+            return -1;
+        }
+        if (bytes) {
+            if ((res = __view_str_equal(self, off, bytes, len)) < 0) {
+                __view_eof__();
+                return -1;
+            }
+            if (!res && ((res = __view_dictref_equal(self, off, key)) < 0)) {
+                return -1;
+            }
+        }
+        else {
+            if (!(item = _View_Unpack(self, off))) {
+                return -1;
+            }
+            res = PyObject_RichCompareBool(item, key, Py_EQ);
+            Py_DECREF(item);
+            if (res < 0) {
+                return -1;
+            }
+        }
+        if (res) {
+            return _View_Item(self, (i + 1));
+        }
+    }
+    return 0;
+}
+
+
+/* View_Type ---------------------------------------------------------------- */
+
+/* View_Type.tp_new */
+static PyObject *
+View_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"msg", "dictionary", NULL};
+    PyObject *module = NULL, *self = NULL, *arg = Py_None, *dictionary = NULL;
+    module_state *state = NULL;
+    Py_buffer msg;
+
+    if (
+        !(module = PyType_GetModule(type)) ||
+        !(state = __PyModule_GetState__(module)) ||
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "y*|$O:__new__", kwlist, &msg, &arg
+        )
+    ) {
+        return NULL;
+    }
+    if (
+        (!(dictionary = DictionaryArg(state, arg)) && PyErr_Occurred()) ||
+        !(self = _View_New(type, module, NULL, &msg, 0, dictionary))
+    ) {
+        PyBuffer_Release(&msg);
+    }
+    return self;
+}
+
+
+/* View_Type.tp_traverse */
+static int
+View_tp_traverse(View *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self)); // heap type
+    Py_VISIT(self->module);
+    Py_VISIT(self->root);
+    Py_VISIT(self->msg.obj);
+    Py_VISIT(self->dictionary);
+    return 0;
+}
+
+
+/* View_Type.tp_clear */
+static int
+View_tp_clear(View *self)
+{
+    if (self->msg.obj) {
+        PyBuffer_Release(&self->msg);
+    }
+    Py_CLEAR(self->dictionary);
+    Py_CLEAR(self->root);
+    Py_CLEAR(self->module);
+    return 0;
+}
+
+
+/* View_Type.tp_dealloc */
+static void
+View_tp_dealloc(View *self)
+{
+    PyObject_GC_UnTrack(self);
+    View_tp_clear(self);
+    ClearScanState(&self->scan);
+    PyMem_Free(self->index);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
+}
+
+
+/* View_Type.mp_length */
+static Py_ssize_t
+View_mp_length(View *self)
+{
+    switch (self->kind) {
+        case VIEW_ARRAY:
+            return self->len;
+        case VIEW_MAP:
+            return (self->len >> 1);
+    }
+    PyErr_SetString(PyExc_TypeError, "view of a non container object");
+    return -1;
+}
+
+
+/* View_Type.mp_subscript */
+static PyObject *
+View_mp_subscript(View *self, PyObject *key)
+{
+    Py_ssize_t i = -1, off = -1;
+
+    switch (self->kind) {
+        case VIEW_ARRAY:
+            if (
+                ((i = PyNumber_AsSsize_t(key, PyExc_IndexError)) == -1) &&
+                PyErr_Occurred()
+            ) {
+                return NULL;
+            }
+            if (i < 0) {
+                i += self->len;
+            }
+            if ((i < 0) || (i >= self->len)) {
+                PyErr_SetString(PyExc_IndexError, "view index out of range");
+                return NULL;
+            }
+            off = _View_Item(self, i);
+            break;
+        case VIEW_MAP:
+            if (!(off = _View_Lookup(self, key))) {
+                _PyErr_SetKeyError(key);
+                return NULL;
+            }
+            break;
+        default:
+            PyErr_SetString(
+                PyExc_TypeError, "view of a non container object"
+            );
+            return NULL;
+    }
+    if (off < 0) {
+        return NULL;
+    }
+    return _View_Get(self, off);
+}
+
+
+/* View.unpack() */
+PyDoc_STRVAR(View_unpack_doc,
+"unpack() -> obj");
+
+static PyObject *
+View_unpack(View *self)
+{
+    return _View_Unpack(self, self->start);
+}
+
+
+/* View_Type.tp_methods */
+static PyMethodDef View_tp_methods[] = {
+    {
+        "unpack", (PyCFunction)View_unpack,
+        METH_NOARGS, View_unpack_doc
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot View_Slots[] = {
+    {Py_tp_doc, "View(msg, *, dictionary=None)"},
+    {Py_tp_new, View_tp_new},
+    {Py_tp_traverse, View_tp_traverse},
+    {Py_tp_clear, View_tp_clear},
+    {Py_tp_dealloc, View_tp_dealloc},
+    {Py_mp_length, View_mp_length},
+    {Py_mp_subscript, View_mp_subscript},
+    {Py_tp_methods, View_tp_methods},
+    {0, NULL}
+};
+
+
+PyType_Spec View_Spec = {
+    .name = "mood.msgpack.View",
+    .basicsize = sizeof(View),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = View_Slots
+};
@@ -1,3 +1,6 @@
+import sys
+
+from array import array
 from enum import IntEnum, IntFlag, unique
 from struct import pack as __pack__
 
@@ -85,6 +88,9 @@ class Extensions(IntFlag):
     PYTHON_CLASS = 0x06
     PYTHON_SINGLETON = 0x07
 
+    PYTHON_ARRAY = 0x08
+    PYTHON_MEMORYVIEW = 0x09
+
     PYTHON_OBJECT = 0x7f        # last
 
     # MessagePack
@@ -327,6 +333,17 @@ def pack_timestamp(o):
 def pack_complex(o):
     return b"".join((__pack__(">d", v) for v in (o.real, o.imag)))
 
+def pack_typed(o):
+    o = memoryview(o)
+    return b"".join(
+        (
+            o.format.lstrip("@").encode(),
+            __pack__("B", o.itemsize),
+            b"<" if sys.byteorder == "little" else b">",
+            o.tobytes()
+        )
+    )
+
 def pack_class(o):
     return b"".join((pack_str(v) for v in (o.__module__, o.__qualname__)))
 
@@ -351,6 +368,8 @@ _extension_types_ = {
     bytearray: lambda o: (Extensions.PYTHON_BYTEARRAY, o),
     type: lambda o: (Extensions.PYTHON_CLASS, pack_class(o)),
     complex: lambda o: (Extensions.PYTHON_COMPLEX, pack_complex(o)),
+    array: lambda o: (Extensions.PYTHON_ARRAY, pack_typed(o)),
+    memoryview: lambda o: (Extensions.PYTHON_MEMORYVIEW, pack_typed(o)),
     Timestamp: lambda o: (Extensions.MSGPACK_TIMESTAMP, pack_timestamp(o))
 }
 
@@ -1,8 +1,11 @@
+import array
 import collections
+import dataclasses
 import datetime
 import math
 import pathlib
 import random
+import sys
 import time
 import unittest
 
@@ -18,6 +21,7 @@ class _TestCase_(unittest.TestCase):
     def _test_pack(self, value):
         _packed = reference.pack(value)
         self.assertEqual(msgpack.pack(value), _packed)
+        self.assertEqual(msgpack.packed_size(value), len(_packed))
         return _packed
 
     def _test_samples(self, values):
@@ -47,6 +51,67 @@ class TestConstant(_TestCase_):
             )
         )
 
+    def test_invalid(self):
+        self.assertRaises(TypeError, msgpack.unpack, b"\xd4\x07\x01")
+
+class TestClass(_TestCase_):
+
+    def test_renamed(self):
+        class Kiki(object):
+            pass
+        self._test_pack(Kiki)
+        Kiki.__qualname__ = "Koko"
+        self._test_pack(Kiki)
+        Kiki.__module__ = "kiki"
+        self._test_pack(Kiki)
+
+    def test_invalid(self):
+        self.assertRaises(TypeError, msgpack.unpack, b"\xd5\x06\x01\x02")
+        self.assertRaises(
+            TypeError, msgpack.unpack, b"\xc7\x0a\x06\xa8builtins\x02"
+        )
+
+
+class Plain:
+
+    def __init__(self, a, b):
+        self.a = a
+        self.b = b
+
+    def __eq__(self, other):
+        return (type(self) is type(other)) and (vars(self) == vars(other))
+
+
+class PlainSlots(Plain):
+    __slots__ = ("c", "d")
+
+
+class Reduced(Plain):
+
+    def __reduce__(self):
+        return (Reduced, (self.a, self.b))
+
+
+class Items(list):
+
+    def __reduce__(self):
+        return (Items, (), vars(self), list(self), None)
+
+
+class Pairs(dict):
+
+    def __reduce__(self):
+        return (Pairs, (), None, None, dict(self))
+
+
+class Counted(Plain):
+    reduced = 0
+
+    def __reduce__(self):
+        Counted.reduced += 1
+        return (Counted, (self.a, self.b))
+
+
 class TestInstance(_TestCase_):
 
     def test_instances(self):
@@ -60,6 +125,39 @@ class TestInstance(_TestCase_):
             )
         )
 
+    def test_plain(self):
+        msgpack.register(Plain, PlainSlots, Reduced)
+        value = PlainSlots(1, [Plain(2, {"e": 3}), Reduced(4, 5)])
+        value.c = "f"
+        msg = msgpack.pack(value)
+        self.assertEqual(msg[2], 0x0b)
+        self.assertEqual(len(msg), msgpack.packed_size(value))
+        result = msgpack.unpack(msg)
+        self.assertEqual(result, value)
+        self.assertEqual(result.c, "f")
+        self.assertFalse(hasattr(result, "d"))
+        self.assertEqual(msgpack.pack(Reduced(1, 2))[2], 0x7f)
+
+    def test_reduce(self):
+        msgpack.register(Items, Pairs)
+        items = Items((1, 2))
+        items.a = 3
+        result = msgpack.unpack(msgpack.pack([items, Pairs(b=4)]))
+        self.assertEqual(result, [[1, 2], {"b": 4}])
+        self.assertIs(type(result[0]), Items)
+        self.assertEqual(result[0].a, 3)
+        self.assertIs(type(result[1]), Pairs)
+
+    def test_reduce_once(self):
+        msgpack.register(Counted)
+        value = Counted(1, 2)
+        for i in range(40):
+            value = [value]
+        for func in (msgpack.pack, msgpack.packed_size):
+            Counted.reduced = 0
+            func(value)
+            self.assertEqual(Counted.reduced, 1)
+
 
 # ------------------------------------------------------------------------------
 
@@ -201,6 +299,71 @@ class TestStr(_TestCase_, TestSeq):
     def test_str8(self):
         self._test_samples(self._samples(8, 5))
 
+    def test_non_ascii(self):
+        self._test_samples(
+            ("a" * p + c + "a" * s)
+            for c in ("\xe9", "\u20ac", "\U0001f600")
+            for p in (0, 7, 15, 31, 40) for s in (0, 9)
+        )
+        self.assertRaises(UnicodeDecodeError, msgpack.unpack, b"\xa2a\xff")
+        self.assertRaises(
+            UnicodeDecodeError, msgpack.unpack, b"\xd9\x21" + b"a" * 32 + b"\x80"
+        )
+
+    def test_no_utf8_cache(self):
+        for value in ("\xe9" * 40, "\u20ac" * 40, "a\U0001f600" * 40):
+            size = sys.getsizeof(value)
+            self.assertEqual(msgpack.unpack(msgpack.pack(value)), value)
+            self.assertEqual(
+                msgpack.packed_size(value), len(msgpack.pack(value))
+            )
+            self.assertEqual(sys.getsizeof(value), size)
+        self.assertRaises(UnicodeEncodeError, msgpack.pack, "\ud800")
+
+
+class TestTyped(_TestCase_):
+
+    _typecodes = "bBhHiIlLqQfd"
+
+    def test_array(self):
+        for typecode in self._typecodes:
+            for size in (0, 1, 5, 1000):
+                value = array.array(typecode, (i % 100 for i in range(size)))
+                result = msgpack.unpack(self._test_pack(value))
+                self.assertIs(type(result), array.array)
+                self.assertEqual(result.typecode, typecode)
+                self.assertEqual(result, value)
+
+    def test_memoryview(self):
+        for typecode in self._typecodes:
+            value = memoryview(array.array(typecode, range(100)))
+            result = msgpack.unpack(self._test_pack(value))
+            self.assertIs(type(result), memoryview)
+            self.assertEqual(result.format, typecode)
+            self.assertEqual(result.tolist(), value.tolist())
+        value = memoryview(bytes(range(16))).cast("B", (4, 4))
+        self.assertEqual(
+            msgpack.unpack(msgpack.pack(value)).tolist(), list(range(16))
+        )
+        self.assertRaises(TypeError, msgpack.pack, memoryview(b"ab").cast("c"))
+        self.assertRaises(BufferError, msgpack.pack, memoryview(b"abcd")[::2])
+
+    def test_byteorder(self):
+        value = array.array("d", (1.5, -2.25, 1e300))
+        msg = bytearray(msgpack.pack(value))
+        swapped = array.array("d", value)
+        swapped.byteswap()
+        pos = len(msg) - len(value.tobytes())
+        msg[pos - 1:pos] = b">" if sys.byteorder == "little" else b"<"
+        msg[pos:] = swapped.tobytes()
+        self.assertEqual(msgpack.unpack(msg), value)
+        self.assertEqual(
+            msgpack.unpack(msg[:2] + b"\x09" + msg[3:]).tolist(),
+            value.tolist()
+        )
+        msg[pos - 2] = 4
+        self.assertRaises(ValueError, msgpack.unpack, msg)
+
 
 # ------------------------------------------------------------------------------
 
@@ -251,11 +414,606 @@ class TestDict(_TestCase_, _TestCont_):
         self._test_samples((dict((i, None) for i in range(s))
                             for s in range(0, 16)))
 
+    def test_invalid_key(self):
+        for i in range(100):
+            self.assertRaises(
+                TypeError, msgpack.unpack, b"\x82\x01\xa3xyz\xc1"
+            )
+
     #def test_overflow(self):
     #    self.assertRaises(OverflowError, msgpack.pack,
     #                      dict((i, None) for i in range((1 << 32))))
 
 
+# ------------------------------------------------------------------------------
+
+class TestPackInto(unittest.TestCase):
+
+    _value = {"a": [1, 2.0, "3"], "b": (None, b"4", {5}), "c": 1j}
+
+    def test_pack_into(self):
+        _packed = msgpack.pack(self._value)
+        buffer = bytearray(len(_packed) + 8)
+        self.assertEqual(
+            msgpack.pack_into(buffer, self._value, 4), len(_packed)
+        )
+        self.assertEqual(buffer[:4], bytearray(4))
+        self.assertEqual(buffer[4:-4], _packed)
+        self.assertEqual(buffer[-4:], bytearray(4))
+        self.assertEqual(msgpack.unpack(memoryview(buffer)[4:]), self._value)
+
+    def test_exact_size(self):
+        for value in (
+            [], [1, 2, 3], {1, 2, 3}, frozenset((1,)), [[1]], {"a": [1]},
+            [[[[[]]]]], [list(range(300))], self._value
+        ):
+            buffer = bytearray(msgpack.packed_size(value))
+            self.assertEqual(msgpack.pack_into(buffer, value), len(buffer))
+            self.assertEqual(buffer, msgpack.pack(value))
+
+    def test_too_small(self):
+        buffer = bytearray(msgpack.packed_size(self._value) - 1)
+        self.assertRaises(ValueError, msgpack.pack_into, buffer, self._value)
+        self.assertEqual(buffer, bytearray(len(buffer)))
+
+    def test_readonly(self):
+        self.assertRaises(TypeError, msgpack.pack_into, bytes(64), self._value)
+
+
+class TestPacker(unittest.TestCase):
+
+    _values = (
+        {"a": [1, 2.0, "3"], "b": (None, b"4", {5}), "c": 1j},
+        ["a" * 512, list(range(64))],
+        None,
+    )
+
+    def test_pack(self):
+        packer = msgpack.Packer()
+        for value in self._values:
+            self.assertEqual(packer.pack(value), msgpack.pack(value))
+            self.assertEqual(packer.pack_bytes(value), msgpack.pack(value))
+
+    def test_high_water(self):
+        packer = msgpack.Packer()
+        self.assertEqual(packer.high_water, 0)
+        sizes = []
+        for value in self._values:
+            packer.pack_bytes(value)
+            sizes.append(msgpack.packed_size(value))
+            self.assertEqual(packer.high_water, max(sizes))
+        packer.clear()
+        self.assertEqual(packer.high_water, 0)
+
+    def test_exported(self):
+        packer = msgpack.Packer()
+        first = packer.pack(self._values[0])
+        second = packer.pack(self._values[1])
+        self.assertEqual(first, msgpack.pack(self._values[0]))
+        self.assertEqual(second, msgpack.pack(self._values[1]))
+
+
+class TestUnpacker(unittest.TestCase):
+
+    _values = (
+        {"a": [1, 2.0, "3"], "b": (None, b"4", {5}), "c": 1j},
+        ("a" * 512, tuple(range(64)), {"d": {"e": (1, (2, (3,)))}}),
+        None,
+        (),
+        {},
+    )
+
+    def test_feed(self):
+        unpacker = msgpack.Unpacker()
+        for value in self._values:
+            unpacker.feed(msgpack.pack(value))
+        self.assertEqual(list(unpacker), list(self._values))
+        self.assertEqual(list(unpacker), [])
+
+    def test_partial(self):
+        unpacker = msgpack.Unpacker()
+        data = b"".join(msgpack.pack(value) for value in self._values)
+        result = []
+        for i in range(len(data)):
+            unpacker.feed(data[i:i + 1])
+            result.extend(unpacker)
+        self.assertEqual(result, list(self._values))
+
+    def test_invalid(self):
+        unpacker = msgpack.Unpacker()
+        unpacker.feed(b"\x92\x01\xc1")
+        self.assertRaises(TypeError, next, unpacker)
+
+
+class TestUnpackFrom(unittest.TestCase):
+
+    _values = TestUnpacker._values
+
+    def test_unpack_from(self):
+        data = b"".join(msgpack.pack(value) for value in self._values)
+        offset, result = 0, []
+        while offset < len(data):
+            value, offset = msgpack.unpack_from(data, offset)
+            result.append(value)
+        self.assertEqual(offset, len(data))
+        self.assertEqual(result, list(self._values))
+        self.assertRaises(EOFError, msgpack.unpack_from, data, len(data))
+        self.assertRaises(ValueError, msgpack.unpack_from, data, len(data) + 1)
+
+    def test_iter_unpack(self):
+        data = b"".join(msgpack.pack(value) for value in self._values)
+        self.assertEqual(list(msgpack.iter_unpack(data)), list(self._values))
+        self.assertEqual(list(msgpack.iter_unpack(b"")), [])
+        self.assertRaises(EOFError, list, msgpack.iter_unpack(data + b"\x92"))
+
+
+class TestMany(unittest.TestCase):
+
+    _values = TestUnpacker._values
+
+    def test_pack_many(self):
+        msg, offsets = msgpack.pack_many(self._values)
+        self.assertEqual(
+            msg, b"".join(msgpack.pack(value) for value in self._values)
+        )
+        self.assertEqual(len(offsets), len(self._values))
+        for value, start, end in zip(
+            self._values, offsets, offsets[1:] + [len(msg)]
+        ):
+            self.assertEqual(msgpack.unpack(msg[start:end]), value)
+        self.assertEqual(msgpack.pack_many(iter(())), (bytearray(), []))
+
+    def test_unpack_many(self):
+        msg, offsets = msgpack.pack_many(self._values)
+        self.assertEqual(msgpack.unpack_many(msg), list(self._values))
+        self.assertEqual(msgpack.unpack_many(b""), [])
+        self.assertRaises(EOFError, msgpack.unpack_many, msg + b"\x92")
+
+
+class TestCacheKeys(unittest.TestCase):
+
+    _records = [
+        {"id": i, "name": "é", "é": i, "a" * 31: None, "b" * 32: i}
+        for i in range(8)
+    ]
+
+    def test_cache_keys(self):
+        msg = msgpack.pack(self._records)
+        result = msgpack.unpack(msg, cache_keys=True)
+        self.assertEqual(result, msgpack.unpack(msg))
+        first, second = (list(r) for r in result[:2])
+        self.assertIs(first[0], second[0])
+        self.assertIs(first[3], second[3])
+        self.assertEqual(
+            list(msgpack.iter_unpack(msg + msg, cache_keys=True)),
+            [result, result]
+        )
+        unpacker = msgpack.Unpacker(cache_keys=True)
+        unpacker.feed(msg)
+        self.assertEqual(list(unpacker), [result])
+
+
+class TestBinViews(unittest.TestCase):
+
+    _value = [b"a" * 300, bytearray(b"bc"), (b"", {"d": b"e" * 70000})]
+
+    def test_bin_views(self):
+        msg = msgpack.pack(self._value)
+        result = msgpack.unpack(msg, bin_views=True)
+        self.assertEqual(result, msgpack.unpack(msg))
+        for view in (result[0], result[1], result[2][0], result[2][1]["d"]):
+            self.assertIs(type(view), memoryview)
+            self.assertTrue(view.readonly)
+            self.assertIs(view.obj, msg)
+        self.assertRaises(BufferError, msg.extend, b"f")  # still exported
+        del result, view
+        msg.extend(b"f")
+
+    def test_bin_views_from(self):
+        msg = bytes(msgpack.pack(self._value) * 2)
+        obj, offset = msgpack.unpack_from(msg, bin_views=True)
+        self.assertEqual(
+            msgpack.unpack_from(msg, offset, bin_views=True),
+            (obj, len(msg))
+        )
+        self.assertEqual(
+            msgpack.unpack_many(msg, bin_views=True), [self._value] * 2
+        )
+        self.assertEqual(
+            list(msgpack.iter_unpack(msg, bin_views=True)), [self._value] * 2
+        )
+
+
+class TestView(unittest.TestCase):
+
+    _value = {
+        "a": 1,
+        "é": [1, (2, 3), {"b": b"c"}, "d" * 300],
+        3: {"e": None, (1, 2): 4.5},
+        "f": list(range(1000)),
+    }
+
+    def test_view(self):
+        view = msgpack.View(msgpack.pack(self._value))
+        self.assertEqual(len(view), 4)
+        self.assertEqual(view["a"], 1)
+        self.assertEqual(view["é"][1][1], 3)
+        self.assertEqual(view["é"][2]["b"], b"c")
+        self.assertEqual(view["é"][-1], "d" * 300)
+        self.assertEqual(view[3][(1, 2)], 4.5)
+        self.assertIsNone(view[3]["e"])
+        self.assertEqual(view["f"][999], 999)
+        self.assertEqual(view["f"].unpack(), self._value["f"])
+        self.assertEqual(view.unpack(), self._value)
+        self.assertRaises(KeyError, view.__getitem__, "g")
+        self.assertRaises(IndexError, view["é"].__getitem__, 4)
+        self.assertRaises(TypeError, len, msgpack.View(msgpack.pack(1)))
+
+    def test_lifetime(self):
+        msg = msgpack.pack(self._value)
+        nested = msgpack.View(msg)["é"][2]
+        self.assertRaises(BufferError, msg.extend, b"g")
+        self.assertEqual(nested["b"], b"c")
+        del nested
+        msg.extend(b"g")
+
+    def test_truncated(self):
+        msg = msgpack.pack(self._value)
+        view = msgpack.View(msg[:-10])
+        self.assertEqual(view["a"], 1)
+        self.assertRaises(EOFError, view["f"].__getitem__, 999)
+        self.assertRaises(EOFError, msgpack.View, b"\xdc\xff\xff")
+        view = msgpack.View(bytearray(b"\x82\xa5abcde\x01\xa5fg"))
+        self.assertRaises(EOFError, view.__getitem__, "fghij")
+        view = msgpack.View(bytearray(b"\x82\xa5abcde\x01\xd9"))
+        self.assertRaises(EOFError, view.__getitem__, "fghij")
+
+
+class TestValidate(unittest.TestCase):
+
+    _value = TestView._value
+
+    def test_validate(self):
+        msg = msgpack.pack(self._value)
+        self.assertEqual(msgpack.validate(msg), (True, len(msg)))
+        self.assertEqual(msgpack.validate(msg + b"\x01"), (True, len(msg)))
+        self.assertEqual(msgpack.validate(b""), (False, 0))
+        self.assertEqual(msgpack.validate(b"\x92\x01\xc1"), (False, 2))
+        self.assertEqual(msgpack.validate(b"\xa3ab"), (False, 0))
+        ok, offset = msgpack.validate(msg[:-1])
+        self.assertFalse(ok)
+
+    def test_limits(self):
+        msg = msgpack.pack(((((1,),),),))
+        self.assertEqual(msgpack.validate(msg, max_depth=4), (True, len(msg)))
+        self.assertEqual(msgpack.validate(msg, max_depth=3), (False, 3))
+        self.assertEqual(msgpack.validate(msg, max_size=5), (True, 5))
+        self.assertEqual(msgpack.validate(msg, max_size=4), (False, 4))
+        self.assertRaises(ValueError, msgpack.validate, msg, max_depth=-1)
+        deep = b"\x91" * 2000 + b"\xc0"
+        self.assertEqual(msgpack.validate(deep), (False, 1024))
+
+    def test_extensions(self):
+        msg = msgpack.pack([[[[1]]]])
+        self.assertEqual(msgpack.validate(msg, max_depth=4), (True, len(msg)))
+        self.assertFalse(msgpack.validate(msg, max_depth=3)[0])
+        self.assertFalse(msgpack.validate(msg, max_depth=1)[0])
+        msg = bytes.fromhex("c70d0391c7090391c7050391d50391c1")
+        self.assertEqual(msgpack.validate(msg), (False, 15))
+        # payloads must end exactly where their header says
+        self.assertEqual(msgpack.validate(b"\xd5\x03\x91\x01"), (True, 4))
+        self.assertEqual(msgpack.validate(b"\xd5\x03\x90\x01"), (False, 3))
+        self.assertEqual(msgpack.validate(b"\xd5\x03\x92\x01"), (False, 4))
+        msg = msgpack.pack({frozenset(((1,),)), 2})
+        self.assertEqual(msgpack.validate(msg), (True, len(msg)))
+        self.assertFalse(msgpack.validate(msg, max_depth=2)[0])
+        msg = msgpack.pack({1, 2}).replace(b"\x02", b"\xc1")
+        self.assertFalse(msgpack.validate(msg)[0])
+        msgpack.compile(Point)
+        msg = msgpack.pack(Point(1, [2], "a"))
+        self.assertEqual(msgpack.validate(msg), (True, len(msg)))
+        self.assertFalse(msgpack.validate(msg, max_depth=1)[0])
+        self.assertFalse(msgpack.validate(msg.replace(b"\xa1a", b"\xc1a"))[0])
+
+
+class TestSelect(unittest.TestCase):
+
+    _value = {
+        "user": {"id": 1, "name": "a", "tags": ["b", "c"]},
+        "items": [{"id": 2}] * 100,
+        "meta": {"user": {"id": 3}},
+        (1, 2): "d",
+    }
+
+    def test_select(self):
+        msg = msgpack.pack(self._value)
+        self.assertEqual(msgpack.unpack(msg, select=()), {})
+        self.assertEqual(
+            msgpack.unpack(msg, select={"user", "nope"}),
+            {"user": self._value["user"]}
+        )
+        self.assertEqual(
+            msgpack.unpack(
+                msg, select=[("user", "id"), ("meta", "user", "id")]
+            ),
+            {"user": {"id": 1}, "meta": {"user": {"id": 3}}}
+        )
+        self.assertEqual(
+            msgpack.unpack(msg, select=[("user", "id"), "user"]),
+            {"user": self._value["user"]}
+        )
+        self.assertEqual(
+            msgpack.unpack(msg, select=[((1, 2),), ("items", "id")]),
+            {(1, 2): "d", "items": self._value["items"]}
+        )
+        self.assertEqual(msgpack.unpack(msgpack.pack(1), select=["a"]), 1)
+        self.assertRaises(ValueError, msgpack.unpack, msg, select=[()])
+        self.assertRaises(EOFError, msgpack.unpack, msg[:-3], select=["user"])
+
+
+
+@dataclasses.dataclass(frozen=True)
+class Point:
+    x: int
+    y: int
+    label: str = ""
+
+
+class Slotted:
+    __slots__ = ("a", "__b")
+
+    def __init__(self, a, b):
+        self.a = a
+        self.__b = b
+
+    def __eq__(self, other):
+        return (self.a, self.__b) == (other.a, other._Slotted__b)
+
+
+class TestRecord(unittest.TestCase):
+
+    def test_dataclass(self):
+        record = msgpack.compile(Point)
+        self.assertEqual(record.fields, ("x", "y", "label"))
+        value = [Point(1, 2), Point(3, 4, "é")]
+        msg = msgpack.pack(value)
+        self.assertEqual(len(msg), msgpack.packed_size(value))
+        self.assertEqual(msgpack.unpack(msg), value)
+        self.assertEqual(msgpack.pack(value[0])[:2], b"\xd7\x0a")
+
+    def test_slots(self):
+        record = msgpack.compile(Slotted)
+        self.assertEqual(record.fields, ("a", "_Slotted__b"))
+        value = Slotted([1, 2], {"c": Slotted(3, None)})
+        self.assertEqual(msgpack.unpack(msgpack.pack(value)), value)
+        self.assertRaises(AttributeError, msgpack.pack, Slotted.__new__(Slotted))
+
+    def test_fields(self):
+        record = msgpack.compile(Point, fields=("y", "x"))
+        try:
+            self.assertEqual(
+                msgpack.unpack(msgpack.pack(Point(1, 2, "a"))), Point(1, 2)
+            )
+        finally:
+            msgpack.compile(Point)
+        self.assertRaises(TypeError, msgpack.compile, TestRecord)
+        self.assertRaises(TypeError, msgpack.compile, Point(1, 2))
+
+    def test_empty(self):
+        @dataclasses.dataclass
+        class Empty:
+            pass
+
+        class EmptySlots:
+            __slots__ = ()
+
+        for cls in (Empty, EmptySlots):
+            self.assertEqual(msgpack.compile(cls).fields, ())
+            value = [cls(), cls()]
+            msg = msgpack.pack(value)
+            self.assertEqual(len(msg), msgpack.packed_size(value))
+            result = msgpack.unpack(msg)
+            self.assertEqual([type(item) for item in result], [cls, cls])
+
+    def test_not_compiled(self):
+        msg = msgpack.pack(Point(1, 2))
+        msg[3] ^= 0xff  # tag
+        self.assertRaises(TypeError, msgpack.unpack, msg)
+
+
+class TestMemo(unittest.TestCase):
+
+    def test_shared(self):
+        a = [1, 2]
+        value = [a, {"a": a}, (a, a), frozenset((3,))]
+        value.append(value[-1])
+        result = msgpack.unpack(msgpack.pack(value, memo=True))
+        self.assertEqual(result, value)
+        self.assertIs(result[1]["a"], result[0])
+        self.assertIs(result[2][1], result[0])
+        self.assertIs(result[4], result[3])
+        result = msgpack.unpack(msgpack.pack(value))
+        self.assertIsNot(result[1]["a"], result[0])
+
+    def test_cycles(self):
+        msgpack.register(Plain)
+        a = []
+        a.append(a)
+        d = {}
+        d["d"] = d
+        p = Plain(1, [])
+        p.b.append(p)
+        result = msgpack.unpack(msgpack.pack([a, d, p], memo=True))
+        self.assertIs(result[0][0], result[0])
+        self.assertIs(result[1]["d"], result[1])
+        self.assertIs(result[2].b[0], result[2])
+
+    def test_reduce(self):
+        msgpack.register(Items)
+        items = Items((1,))
+        items.append(items)
+        items.a = items
+        result = msgpack.unpack(msgpack.pack(items, memo=True))
+        self.assertIs(type(result), Items)
+        self.assertIs(result[1], result)
+        self.assertIs(result.a, result)
+
+    def test_select(self):
+        a = [1, 2]
+        value = {"skip": {"a": a}, "keep": a, "self": None, "more": a}
+        value["self"] = value
+        msg = msgpack.pack(value, memo=True)
+        result = msgpack.unpack(msg, select=["keep", ("self", "more")])
+        self.assertEqual(result["keep"], a)
+        self.assertIs(result["self"], result)
+        self.assertEqual(list(result), ["keep", "self"])
+        result = msgpack.unpack(msg, select=["more"])
+        self.assertEqual(result, {"more": a})
+        self.assertRaises(TypeError, msgpack.View, msg)
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, msgpack.unpack, b"\xd4\x0d\x00")
+        self.assertRaises(
+            ValueError, msgpack.unpack, b"\xc7\x05\x0c\x92\xd4\x0d\x01\xc0"
+        )
+
+
+class TestDedupStrings(unittest.TestCase):
+
+    def test_records(self):
+        value = [
+            {"name": name, "status": status}
+            for name in ("alpha", "beta", "gamma")
+            for status in ("active", "inactive", "é" * 300)
+        ]
+        msg = msgpack.pack(value, dedup_strings=True)
+        self.assertLess(len(msg), len(msgpack.pack(value)) // 2)
+        for cache_keys in (False, True):
+            result = msgpack.unpack(msg, cache_keys=cache_keys)
+            self.assertEqual(result, value)
+            self.assertIs(result[0]["name"], result[1]["name"])
+            self.assertIs(result[0]["status"], result[3]["status"])
+        msg = msgpack.pack(value, dedup_strings=True, memo=True)
+        self.assertEqual(msgpack.unpack(msg), value)
+
+    def test_slots(self):
+        msgpack.register(PlainSlots)
+        value = PlainSlots("c", "d")
+        value.c = "abc"
+        value = [value, value, "abc", "c"]
+        result = msgpack.unpack(msgpack.pack(value, dedup_strings=True))
+        self.assertEqual(result, value)
+        self.assertIs(result[2], result[0].c)
+
+    def test_select(self):
+        value = {
+            "skip": ["alpha", {"beta": "gamma"}],
+            "keep": {"alpha": "beta", "gamma": 1},
+            "more": ["gamma", "alpha"],
+        }
+        for memo in (False, True):
+            msg = msgpack.pack(value, dedup_strings=True, memo=memo)
+            result = msgpack.unpack(msg, select=[("keep", "gamma"), "more"])
+            self.assertEqual(
+                result, {"keep": {"gamma": 1}, "more": ["gamma", "alpha"]}
+            )
+            self.assertRaises(TypeError, msgpack.View, msg)
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, msgpack.unpack, b"\xd4\x0f\x00")
+
+
+class Tagged(Plain):
+
+    def __reduce__(self):
+        return (Tagged, (self.a, self.b))
+
+
+class TaggedSlots(PlainSlots):
+    __slots__ = ()
+
+
+class TestClassId(unittest.TestCase):
+
+    def test_reduce(self):
+        msgpack.register(Tagged, id=1)
+        self.assertEqual(msgpack.pack(Tagged), b"\xd4\x10\x01")
+        value = [Tagged(i, str(i)) for i in range(3)]
+        msg = msgpack.pack(value)
+        self.assertEqual(len(msg), msgpack.packed_size(value))
+        self.assertEqual(msgpack.unpack(msg), value)
+
+    def test_instance(self):
+        msgpack.register(TaggedSlots, id=300)
+        self.assertEqual(msgpack.pack(TaggedSlots), b"\xd5\x10\x01\x2c")
+        value = TaggedSlots(1, 2)
+        value.c = 3
+        msg = msgpack.pack(value)
+        self.assertEqual(msg[3:7], b"\xd5\x10\x01\x2c")
+        self.assertEqual(len(msg), msgpack.packed_size(value))
+        result = msgpack.unpack(msg)
+        self.assertEqual(result, value)
+        self.assertEqual(result.c, 3)
+
+    def test_invalid(self):
+        msgpack.register(Tagged, id=1)
+        self.assertRaises(ValueError, msgpack.register, Tagged, id=2)
+        self.assertRaises(ValueError, msgpack.register, Plain, id=1)
+        self.assertRaises(ValueError, msgpack.register, Plain, id=-1)
+        self.assertRaises(ValueError, msgpack.register, Plain, id=65536)
+        self.assertRaises(TypeError, msgpack.register, Plain, Tagged, id=3)
+        self.assertRaises(TypeError, msgpack.register, Tagged(1, 2), id=3)
+        self.assertRaises(TypeError, msgpack.unpack, b"\xd4\x10\xfe")
+
+
+class TestDictionary(unittest.TestCase):
+
+    def test_pack(self):
+        dictionary = msgpack.Dictionary(["status", "active", Plain, "a"])
+        value = [{"status": "active", "b": "a"}, Plain, "inactive"]
+        msg = msgpack.pack(value, dictionary=dictionary)
+        self.assertLess(len(msg), len(msgpack.pack(value)))
+        self.assertEqual(
+            msgpack.pack(Plain, dictionary=dictionary), b"\xd4\x11\x02"
+        )
+        result = msgpack.unpack(msg, dictionary=dictionary)
+        self.assertEqual(result, value)
+        self.assertIs(result[0]["b"], dictionary.items[3])
+        msg = msgpack.pack(value, dictionary=dictionary, dedup_strings=True)
+        self.assertEqual(msgpack.unpack(msg, dictionary=dictionary), value)
+
+    def test_stream(self):
+        dictionary = msgpack.Dictionary(("a", "b"))
+        packer = msgpack.Packer(dictionary=dictionary)
+        unpacker = msgpack.Unpacker(dictionary=dictionary)
+        for value in ({"a": "b"}, ["b", "c"]):
+            unpacker.feed(packer.pack_bytes(value))
+        self.assertEqual(list(unpacker), [{"a": "b"}, ["b", "c"]])
+
+    def test_view(self):
+        dictionary = msgpack.Dictionary(["alpha", "beta", Plain])
+        value = {"alpha": {"beta": "alpha"}, "gamma": Plain, 1: "beta"}
+        msg = msgpack.pack(value, dictionary=dictionary)
+        view = msgpack.View(msg, dictionary=dictionary)
+        self.assertEqual(view["alpha"]["beta"], "alpha")
+        self.assertIs(view["gamma"], Plain)
+        self.assertEqual(view[1], "beta")
+        self.assertEqual(view.unpack(), value)
+        self.assertRaises(KeyError, view.__getitem__, "delta")
+        self.assertRaises(ValueError, msgpack.View(msg).__getitem__, "alpha")
+        self.assertRaises(TypeError, msgpack.View, msg, dictionary={})
+
+    def test_invalid(self):
+        self.assertRaises(TypeError, msgpack.Dictionary, ["a", 1])
+        self.assertRaises(ValueError, msgpack.Dictionary, ["a", "a"])
+        self.assertRaises(TypeError, msgpack.pack, "a", dictionary={})
+        msg = msgpack.pack("a", dictionary=msgpack.Dictionary(["a"]))
+        self.assertRaises(ValueError, msgpack.unpack, msg)
+        self.assertRaises(
+            ValueError, msgpack.unpack, msg, dictionary=msgpack.Dictionary([])
+        )
+
+
 # ------------------------------------------------------------------------------
 
 if __name__ == "__main__":